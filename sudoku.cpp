@@ -1,50 +1,907 @@
 #include <algorithm>
 #include <iostream>
+#include <fstream>
 #include <mpi.h>
 #include <math.h>
 #include <vector>
 #include <random>
 #include <iomanip>
 #include <chrono>
+#include <string>
+#include <cstdint>
+#include <type_traits>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <climits>
+#include <list>
+#include <unordered_map>
+#include <new>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <csignal>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
-#define MCW MPI_COMM_WORLD
+// The communicator every run talks over. It is MPI_COMM_WORLD except while a benchmark
+// sweep runs on a subset of the ranks (see runBenchmark).
+MPI_Comm activeComm = MPI_COMM_WORLD;
+#define MCW activeComm
 
-#define N 9
-#define box 3
+// Heap allocations this process has made through operator new, so the benchmark can show
+// that the work loop does not allocate once it is warm.
+std::atomic<long long> heapAllocations(0);
 
-void fillBox(std::vector<int> &puzzle);
-std::vector<int> generatePuzzle(bool basic);
-void generateQueue(std::vector<std::vector<int> > &queue, std::vector<int> puzzle);
-int getBox(int puzzleIndex);
-int getColumn(int puzzleIndex);
-int getRow(int puzzleIndex);
-bool isValid(std::vector<int> puzzle);
-void printPuzzle(std::vector<int> puzzle);
+//All of these stay out of line, where GCC would otherwise pair an inlined malloc or free
+//with the library's own operators and warn.
+__attribute__((noinline)) void *operator new(size_t bytes)
+{
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = malloc(bytes ? bytes : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void *operator new(size_t bytes, std::align_val_t align)
+{
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = nullptr;
+    if (posix_memalign(&p, std::max((size_t)align, sizeof(void *)), bytes ? bytes : 1) == 0)
+        return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, std::align_val_t) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t, std::align_val_t) noexcept
+{
+    free(p);
+}
+
+// Width of the SIMD batch kernel's vectors: one register of the widest vector unit the
+// build targets, so -march=native picks AVX2 or AVX-512 and the default build SSE2.
+#if defined(__AVX512BW__)
+const int LANE_BYTES = 64;
+#elif defined(__AVX2__)
+const int LANE_BYTES = 32;
+#else
+const int LANE_BYTES = 16;
+#endif
+
+// Board geometry for a grid made of B x B boxes, so N = B * B digits per unit.
+// Every solver, the frontier generator and the printer are templated on B, and one
+// binary carries the 9x9, 16x16, 25x25 and 36x36 instances (see runPuzzles).
+template <int B>
+struct Geometry
+{
+    static constexpr int box = B;
+    static constexpr int N = B * B;
+    static constexpr int CELLS = N * N;
+    // Every cell sees N - 1 others in each of its row, column and box, minus the overlaps.
+    static constexpr int PEERS = 3 * N - 2 * B - 1;
+    // Narrowest signed type that holds every digit and -1 for an empty cell.
+    typedef typename std::conditional<(N < 128), int8_t, int16_t>::type Cell;
+    // One bit per digit, bit (v - 1) stands for the value v.
+    typedef typename std::conditional<(N <= 32), uint32_t, uint64_t>::type Mask;
+    static constexpr Mask ALL_DIGITS = (Mask)(((uint64_t)1 << N) - 1);
+    // Narrowest mask word for the SIMD batch kernel, and how many boards share one
+    // LANE_BYTES vector of them (see LaneBatch).
+    typedef typename std::conditional<(N <= 16), uint16_t, typename std::conditional<(N <= 32), uint32_t, uint64_t>::type>::type LaneWord;
+    static constexpr int LANES = LANE_BYTES / sizeof(LaneWord);
+    // Bits per cell on the wire, enough for 0 (empty) through N.
+    static constexpr int VALUE_BITS = N < 16 ? 4 : (N < 32 ? 5 : 6);
+    // Largest packed board: the format byte plus every cell.
+    static constexpr int MAX_PACKED_BYTES = 1 + (CELLS * VALUE_BITS + 7) / 8;
+    // Largest share of a grant per board: the packed board and its cost estimate.
+    static constexpr int MAX_GRANT_ENTRY_BYTES = MAX_PACKED_BYTES + sizeof(float);
+};
+
+// One board by value: a fixed array of cells, -1 for empty, aligned to a cache line. It
+// keeps the part of the std::vector interface the code uses, so boards are stored, copied
+// and returned without touching the heap. Sizes passed to it are always CELLS.
+template <int B>
+struct alignas(64) Board
+{
+    typedef typename Geometry<B>::Cell Cell;
+    Cell cells[Geometry<B>::CELLS];
+
+    Board() { assign(0, -1); }
+    explicit Board(int, int value = 0) { assign(0, value); }
+    Board(const Cell *first, const Cell *last) { assign(first, last); }
+
+    static constexpr size_t size() { return Geometry<B>::CELLS; }
+    void resize(int) {}
+    void assign(int, int value) { memset(cells, value, sizeof(cells)); }
+    void assign(const Cell *first, const Cell *last) { std::copy(first, last, cells); }
+    Cell *data() { return cells; }
+    const Cell *data() const { return cells; }
+    Cell *begin() { return cells; }
+    Cell *end() { return cells + Geometry<B>::CELLS; }
+    const Cell *begin() const { return cells; }
+    const Cell *end() const { return cells + Geometry<B>::CELLS; }
+    Cell &operator[](int i) { return cells[i]; }
+    const Cell &operator[](int i) const { return cells[i]; }
+    bool operator==(const Board &other) const { return memcmp(cells, other.cells, sizeof(cells)) == 0; }
+    bool operator!=(const Board &other) const { return !(*this == other); }
+};
+
+// The boards generateQueue hands out, stored back to back in one buffer, most expensive
+// first. cost holds log2 of each board's estimated subtree size (see estimateCost).
+template <int B>
+struct Frontier
+{
+    std::vector<typename Geometry<B>::Cell> cells;
+    std::vector<float> cost;
+
+    int size() const { return cells.size() / Geometry<B>::CELLS; }
+    const typename Geometry<B>::Cell *operator[](int i) const { return cells.data() + (size_t)i * Geometry<B>::CELLS; }
+};
+
+// Lookup tables for one geometry, all built at compile time: the row, column and box
+// of every cell, rows/columns/boxes as cell lists, every cell's peers, and every
+// line/box intersection split into the shared cells, the rest of the line and the rest of the box.
+template <int B>
+struct PeerTable
+{
+    static constexpr int N = B * B;
+    short rowOf[N * N];
+    short colOf[N * N];
+    short boxOf[N * N];
+    short units[3 * N][N];
+    short peers[N * N][3 * N - 2 * B - 1];
+    short intersection[2 * N * B][B];
+    short lineRest[2 * N * B][N - B];
+    short boxRest[2 * N * B][N - B];
+};
+
+template <int B>
+constexpr PeerTable<B> buildPeerTable();
+
+template <int B>
+inline constexpr PeerTable<B> peerTable = buildPeerTable<B>();
+
+template <int B>
+void fillBox(Board<B> &puzzle, int boxNum, std::mt19937 &rng);
+template <int B>
+Board<B> generatePuzzle(bool basic, std::mt19937 &rng, long long *difficulty = nullptr);
+template <int B>
+void generateQueue(Frontier<B> &frontier, const Board<B> &puzzle, int target);
+template <int B>
+constexpr int getBox(int puzzleIndex);
+template <int B>
+constexpr int getColumn(int puzzleIndex);
+template <int B>
+constexpr int getRow(int puzzleIndex);
+template <int B>
+bool isValid(const Board<B> &puzzle);
+template <int B>
+void printPuzzle(const Board<B> &puzzle);
 void report(std::vector<long long> allCompletionTimes);
-bool solvePuzzle(std::vector<int> &puzzle);
+long long percentile(const std::vector<long long> &sorted, int p);
+template <int B>
+bool solvePuzzle(Board<B> &puzzle);
+template <int B>
+bool solvePuzzleBitmask(Board<B> &puzzle);
+template <int B>
+bool solvePuzzleDancingLinks(Board<B> &puzzle);
+template <int B>
+bool solvePuzzlePropagation(Board<B> &puzzle);
+template <int B>
+int packBoard(const typename Geometry<B>::Cell *puzzle, uint8_t *out);
+template <int B>
+int packBoard(const Board<B> &puzzle, uint8_t *out);
+template <int B>
+int unpackBoard(const uint8_t *in, Board<B> &puzzle);
+template <int B>
+int packGrant(const std::vector<Board<B> > &queue, int first, int quantity, std::vector<uint8_t> &buffer);
+template <int B>
+int packGrant(const Frontier<B> &frontier, int first, int quantity, std::vector<uint8_t> &buffer);
+template <int B>
+void sendGrant(const Frontier<B> &frontier, int first, int quantity, int dest, std::vector<uint8_t> &buffer);
+template <int B>
+int receiveGrant(const std::vector<uint8_t> &buffer, std::vector<Board<B> > &queue, std::vector<float> *estimates = nullptr);
+void drainMessages();
+template <int B>
+bool stealWork(int rank, int size, std::vector<Board<B> > &seed);
+template <int B>
+bool solveOnThreads(int threads, int workerQueueSize, std::vector<uint8_t> &grant);
+struct Outbox;
+void retireWorker(Outbox &outbox, MPI_Request &grantRecv, bool grantArmed);
+template <int B>
+int superviseWorkers(int size, const Frontier<B> &queue, int workerQueueSize, Board<B> &solution, std::chrono::steady_clock::time_point &foundTime, const std::vector<int> *groupStart = nullptr, bool solveHere = false);
+template <int B>
+void dealFrontier(Frontier<B> &frontier, int groups, std::vector<int> &groupStart);
+void openSharedFrontier();
+void reserveSharedFrontier(size_t bytes);
+void releaseSharedFrontier();
+template <int B>
+void fillSharedFrontier(const typename Geometry<B>::Cell *boards, int count);
+template <int B>
+void solveSharedFrontier(int rank, Outbox &outbox);
+template <int B>
+int superviseSharedFrontier(const Frontier<B> &queue, Board<B> &solution, std::chrono::steady_clock::time_point &foundTime);
 
-const int TAG_PUZZLE = 0;
-const int TAG_QUANTITY = 1;
+// What rank 0 learns from solving one puzzle across the ranks (see solveShared).
+template <int B>
+struct PuzzleOutcome
+{
+    // Rank that solved the puzzle, -1 if nobody did. Rank 0 only solves with --master-solves.
+    int winner;
+    // True when rank 0 found the answer in the solve cache and no worker ran.
+    bool cached;
+    Board<B> solution;
+    int frontierSize;
+    long long frontierTime;
+    // Microseconds from the start of the frontier until the outcome was known, and from
+    // then until every worker was idle.
+    long long completionTime;
+    long long cancelTime;
+    long long nodes;
+    // Heap allocations the workers made while solving it.
+    long long allocations;
+    // Solutions counted by all workers when counting.
+    long long solutions;
+    // STAT_COLUMNS counters per rank, in rank order, in builds with SUDOKU_STATS.
+    std::vector<long long> rankStats;
+};
+
+// Columns of the per-rank utilisation table: nodes, the RankStats fields and wall time.
+const int STAT_COLUMNS = 7;
+void printRankStats(const std::vector<long long> &stats, int size);
+void writeTrace(int rank, int size);
+
+const int TAG_GRANT = 0;
 const int TAG_MORE = 2;
 const int TAG_SOLVED = 3;
-const int TAG_POISON = 4;
-const int TAG_ACK = 5;
+const int TAG_BATCH = 6;
+const int TAG_BATCH_RESULT = 7;
+const int TAG_STEAL_REQUEST = 8;
+const int TAG_STEAL_REPLY = 9;
+const int TAG_TOKEN = 10;
+const int TAG_STOP = 11;
+const int TAG_DONE = 12;
+const int TAG_COUNT = 13;
+const int TAG_PIPE_GRANT = 14;
+const int TAG_PIPE_RESULT = 15;
+const int TAG_CANCEL = 16;
+const int TAG_SERVICE_GRANT = 17;
+const int TAG_SERVICE_RESULT = 18;
+
+// Outcome of a grant in a pipelined run (see servePipeline).
+const int PIPE_EXHAUSTED = 0;
+const int PIPE_SOLVED = 1;
+const int PIPE_CANCELLED = 2;
+
+// Which search engine the workers run. The reference path is the original cell-order DFS.
+enum SolverType
+{
+    SOLVER_REFERENCE,
+    SOLVER_BITMASK,
+    SOLVER_DLX,
+    SOLVER_PROPAGATE
+};
+
+// How rank 0 shares the frontier. Master hands out grants on request, steal seeds the
+// workers and lets them balance, portfolio races a different search strategy per worker,
+// and shared puts each node's share in a shared memory window (see SharedFrontier).
+enum Schedule
+{
+    SCHEDULE_MASTER,
+    SCHEDULE_STEAL,
+    SCHEDULE_PORTFOLIO,
+    SCHEDULE_SHARED
+};
+
+// What batch mode writes for each puzzle (see formatResult). Lines is the bare solution
+// line, text adds the puzzle's index, solve time and search nodes in fixed width columns,
+// and binary packs the same fields into fixed size records.
+enum ResultFormat
+{
+    RESULT_LINES,
+    RESULT_TEXT,
+    RESULT_BINARY
+};
+
+// Branching choices of one portfolio racer. Every cell order starts from the most
+// constrained cell and differs only in how ties between equally constrained cells break.
+enum CellOrder
+{
+    CELL_MRV,
+    CELL_MRV_DEGREE,
+    CELL_MRV_RANDOM
+};
+
+enum ValueOrder
+{
+    VALUE_ASCENDING,
+    VALUE_DESCENDING,
+    VALUE_RANDOM
+};
+
+struct SearchStrategy
+{
+    CellOrder cells;
+    ValueOrder values;
+    // Start over with a growing node cutoff, only useful with some randomness.
+    bool restarts;
+    std::mt19937 rng;
+    // Fixed size, so making a strategy for every puzzle stays off the heap.
+    char name[64];
+};
+
+SearchStrategy makeStrategy(int index);
+
+// Trial placements made by this thread's solver since the start of the current puzzle.
+// Solver threads add theirs to the rank's count when they finish (see solveOnThreads).
+thread_local long long nodesVisited = 0;
+
+// Per-rank counters for the utilisation table and the trace timeline. Both only exist in
+// builds with -DSUDOKU_STATS; otherwise every STAT_ and TRACE_ hook expands to nothing and
+// the hot paths are exactly as without them.
+struct RankStats
+{
+    // Times a search undid a placement, and candidate tests (placements checked).
+    long long backtracks;
+    long long placements;
+    // Boards received in grants and steal replies.
+    long long boards;
+    // Microseconds spent waiting for work, and spent inside MPI calls, waits included.
+    long long idleMicros;
+    long long mpiMicros;
+};
+
+#ifdef SUDOKU_STATS
+thread_local RankStats rankStats = {};
+
+// Adds the lifetime of the timer to one RankStats field of the current thread.
+struct StatTimer
+{
+    long long RankStats::*field;
+    std::chrono::steady_clock::time_point start;
+    explicit StatTimer(long long RankStats::*f) : field(f), start(std::chrono::steady_clock::now()) {}
+    ~StatTimer() { rankStats.*field += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count(); }
+};
+
+// One Chrome trace event: a span ('X') or an instant ('i') on one thread of this rank,
+// in microseconds since traceEpoch. value is shown as an argument unless it is -1.
+struct TraceEvent
+{
+    const char *name;
+    char phase;
+    int thread;
+    long long start;
+    long long duration;
+    long long value;
+};
+
+bool tracing = false;
+std::chrono::steady_clock::time_point traceEpoch;
+std::vector<TraceEvent> traceEvents;
+std::mutex traceLock;
+// 0 is the rank's main thread, solver threads are numbered from 1.
+thread_local int traceThread = 0;
+
+inline long long traceNow()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - traceEpoch).count();
+}
+
+inline void traceEvent(const char *name, char phase, long long start, long long duration, long long value)
+{
+    std::lock_guard<std::mutex> guard(traceLock);
+    traceEvents.push_back({name, phase, traceThread, start, duration, value});
+}
+
+// Records the lifetime of the span as one trace event.
+struct TraceSpan
+{
+    const char *name;
+    long long start;
+    long long value;
+    explicit TraceSpan(const char *n, long long v = -1) : name(n), start(tracing ? traceNow() : 0), value(v) {}
+    ~TraceSpan()
+    {
+        if (tracing)
+            traceEvent(name, 'X', start, traceNow() - start, value);
+    }
+};
+
+#define STAT_ADD(field, amount) (rankStats.field += (amount))
+#define STAT_TIMER(var, field) StatTimer var(&RankStats::field)
+#define TRACE_SPAN(var, ...) TraceSpan var(__VA_ARGS__)
+#define TRACE_INSTANT(name, value) (tracing ? traceEvent(name, 'i', traceNow(), 0, value) : (void)0)
+
+// Time in MPI is measured through the profiling interface: these replace the library's
+// entry points for every call that can take a while and forward to the PMPI versions.
+extern "C"
+{
+int MPI_Send(const void *buf, int count, MPI_Datatype type, int dest, int tag, MPI_Comm comm)
+{
+    STAT_TIMER(timer, mpiMicros);
+    return PMPI_Send(buf, count, type, dest, tag, comm);
+}
+int MPI_Issend(const void *buf, int count, MPI_Datatype type, int dest, int tag, MPI_Comm comm, MPI_Request *request)
+{
+    STAT_TIMER(timer, mpiMicros);
+    return PMPI_Issend(buf, count, type, dest, tag, comm, request);
+}
+int MPI_Recv(void *buf, int count, MPI_Datatype type, int source, int tag, MPI_Comm comm, MPI_Status *status)
+{
+    STAT_TIMER(timer, mpiMicros);
+    return PMPI_Recv(buf, count, type, source, tag, comm, status);
+}
+int MPI_Probe(int source, int tag, MPI_Comm comm, MPI_Status *status)
+{
+    STAT_TIMER(timer, mpiMicros);
+    return PMPI_Probe(source, tag, comm, status);
+}
+int MPI_Iprobe(int source, int tag, MPI_Comm comm, int *flag, MPI_Status *status)
+{
+    STAT_TIMER(timer, mpiMicros);
+    return PMPI_Iprobe(source, tag, comm, flag, status);
+}
+int MPI_Wait(MPI_Request *request, MPI_Status *status)
+{
+    STAT_TIMER(timer, mpiMicros);
+    return PMPI_Wait(request, status);
+}
+int MPI_Waitall(int count, MPI_Request requests[], MPI_Status statuses[])
+{
+    STAT_TIMER(timer, mpiMicros);
+    return PMPI_Waitall(count, requests, statuses);
+}
+int MPI_Waitany(int count, MPI_Request requests[], int *index, MPI_Status *status)
+{
+    STAT_TIMER(timer, mpiMicros);
+    return PMPI_Waitany(count, requests, index, status);
+}
+int MPI_Test(MPI_Request *request, int *flag, MPI_Status *status)
+{
+    STAT_TIMER(timer, mpiMicros);
+    return PMPI_Test(request, flag, status);
+}
+int MPI_Testany(int count, MPI_Request requests[], int *index, int *flag, MPI_Status *status)
+{
+    STAT_TIMER(timer, mpiMicros);
+    return PMPI_Testany(count, requests, index, flag, status);
+}
+int MPI_Barrier(MPI_Comm comm)
+{
+    STAT_TIMER(timer, mpiMicros);
+    return PMPI_Barrier(comm);
+}
+int MPI_Bcast(void *buf, int count, MPI_Datatype type, int root, MPI_Comm comm)
+{
+    STAT_TIMER(timer, mpiMicros);
+    return PMPI_Bcast(buf, count, type, root, comm);
+}
+int MPI_Reduce(const void *in, void *out, int count, MPI_Datatype type, MPI_Op op, int root, MPI_Comm comm)
+{
+    STAT_TIMER(timer, mpiMicros);
+    return PMPI_Reduce(in, out, count, type, op, root, comm);
+}
+}
+#else
+#define STAT_ADD(field, amount) ((void)0)
+#define STAT_TIMER(var, field)
+#define TRACE_SPAN(var, ...)
+#define TRACE_INSTANT(name, value) ((void)0)
+#endif
+// Path of the Chrome trace written at the end of the run, empty for none.
+std::string tracePath;
+
+// Worst-case time in microseconds between rank 0 stopping a puzzle and a solver noticing it.
+// The stop is tested with MPI only this often.
+long long cancelLatency = 100;
+// Random probes per frontier board for the subtree size estimate, 0 to estimate from
+// candidate counts alone.
+int costProbes = 0;
+// Per-rank log of estimated against actual search nodes per board, empty for none.
+std::string costLogPath;
+// Base seed of the puzzle generator. Puzzle k of a run or a corpus is generated from
+// generatorSeed + k, so the same seed gives the same puzzles on any number of ranks.
+unsigned generatorSeed = 0;
+// Search nodes the generator's uniqueness proof must take at least, 0 for any puzzle.
+long long difficultyTarget = 0;
+// Solutions to count per puzzle instead of stopping at the first one: -1 to solve,
+// 0 to count them all.
+long long countLimit = -1;
+// Per-rank file every counted solution is written to, empty for none.
+std::string solutionsPath;
+// Groups of workers in the portfolio schedule. The frontier is split between the groups
+// and the workers of a group race each other over the same boards.
+int portfolioGroups = 1;
+// Whether boards print as bordered grids instead of one line each (--grids).
+bool printGrids = false;
+
+// The stop broadcast of the puzzle a worker is solving (see serveWorker). Null whenever
+// nobody can cancel the solver, such as in batch mode or on rank 0.
+MPI_Request *stopSignal = nullptr;
+
+// Whether rank 0 searches frontier boards itself while it supervises (--master-solves).
+bool masterSolves = false;
+
+// Start of the shared schedule's window. The boards follow it, then the solution.
+struct SharedHeader
+{
+    // First board nobody has claimed yet.
+    std::atomic<int> next;
+    // Ranks of the node that have run out of boards or stopped.
+    std::atomic<int> finished;
+    // Rank that solved the puzzle, -1 while nobody has, and set once its solution is in.
+    std::atomic<int> winner;
+    std::atomic<bool> ready;
+    int count;
+};
+
+// The shared schedule's view of the machine: the ranks of this node, the node leaders
+// (node rank 0 of every node, which includes rank 0) and an MPI-3 shared memory window
+// owned by the leader. The leader fills the window with the node's share of the frontier
+// and every solver of the node claims boards from it with a fetch-and-add on next, so
+// boards move within a node without messages. Only the leaders talk to rank 0. Built
+// on first use and kept until releaseSharedFrontier, growing the window when needed.
+struct SharedFrontier
+{
+    MPI_Comm node = MPI_COMM_NULL;
+    MPI_Comm leaders = MPI_COMM_NULL;
+    int nodeRank;
+    int nodeSize;
+    // On rank 0: the ranks of every node, in leader order.
+    std::vector<int> nodeSizes;
+    MPI_Win window = MPI_WIN_NULL;
+    size_t capacity = 0;
+    SharedHeader *header;
+    uint8_t *data;
+};
+
+SharedFrontier sharedFrontier;
+
+// Puzzles a pipelined run keeps in flight, 0 for one puzzle at a time (see runPipeline).
+int pipelineDepth = 0;
+// Puzzle a pipelined worker is solving, or -1, and whether rank 0 has cancelled it.
+int pipelinePuzzle = -1;
+bool pipelineStopped = false;
+
+// One character per cell in batch files: digits 1-9, then letters for the larger grids.
+// An empty cell is '.' or '0'.
+const char DIGIT_CHARS[] = "123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ@";
+
+// A read only memory mapping of a batch file with one puzzle per line.
+// Every line must have the same length, so puzzle k starts at k * stride.
+struct PuzzleFile
+{
+    const char *data;
+    size_t bytes;
+    int length;
+    int stride;
+    long long count;
+};
+
+// One puzzle line a service client sent, waiting for or out at a worker (see runService).
+struct ServiceRequest
+{
+    long long connection;
+    long long sequence;
+    std::chrono::steady_clock::time_point arrival;
+    std::string puzzle;
+};
+
+// A reply that is ready but still waits for the replies to earlier requests of its client.
+struct ServiceReply
+{
+    std::string line;
+    std::chrono::steady_clock::time_point arrival;
+};
+
+// One client of the service. Replies go out in request order: done holds the ones that
+// came back early, keyed by sequence, until every request before them is answered.
+struct ServiceConnection
+{
+    int fd;
+    std::string input;
+    std::string output;
+    long long nextSequence;
+    long long nextReply;
+    std::map<long long, ServiceReply> done;
+    bool closing;
+};
+
+// Replies the service has sent, and the latencies of the last SERVICE_WINDOW of them in
+// a ring, from reading the request to queueing its reply.
+struct ServiceMetrics
+{
+    long long replies;
+    std::vector<long long> recent;
+};
+
+const size_t SERVICE_WINDOW = 1 << 16;
+
+// Set by SIGINT, SIGTERM or a shutdown request, ends the service once its work is done.
+volatile sig_atomic_t serviceStopping = 0;
+
+// Solved puzzles keyed by their canonical form (see canonicalize), most recently used
+// first and at most capacity of them. An empty solution records a puzzle that has none.
+// With a file the same entries also go to a shared memory mapping, one slot per key hash,
+// so they outlive the run.
+struct SolveCache
+{
+    size_t capacity;
+    std::list<std::pair<std::string, std::string> > entries;
+    std::unordered_map<std::string, std::list<std::pair<std::string, std::string> >::iterator> index;
+    std::string path;
+    uint8_t *table;
+    size_t tableBytes;
+    long long slots;
+    int cells;
+    long long hits;
+    long long misses;
+};
+
+// Only rank 0 ever fills it. A capacity of 0 turns the cache off.
+SolveCache solveCache = {0, {}, {}, "", nullptr, 0, 0, 0, 0, 0};
+
+// How canonicalize maps a board onto its representative: transpose it if asked, then
+// canonical row r is row rows[r] and canonical column c is column columns[c], and every
+// digit d becomes digits[d].
+template <int B>
+struct Transform
+{
+    bool transpose;
+    short rows[B * B];
+    short columns[B * B];
+    short digits[B * B + 1];
+};
+
+template <int B>
+void canonicalize(const Board<B> &puzzle, Board<B> &canonical, Transform<B> &transform);
+int findCached(const std::string &key, std::string &solution);
+void storeCached(const std::string &key, const std::string &solution);
+bool openCacheFile(int cells);
+void closeSolveCache();
+bool mapPuzzleFile(const char *path, PuzzleFile &file);
+void unmapPuzzleFile(PuzzleFile &file);
+template <int B>
+bool parsePuzzle(const char *line, Board<B> &puzzle);
+template <int B>
+void formatSolution(const Board<B> &puzzle, bool solved, char *line);
+template <int B>
+void formatPuzzle(const Board<B> &puzzle, char *line);
+template <int B>
+int resultBytes(ResultFormat format);
+template <int B>
+void formatResult(ResultFormat format, long long id, const Board<B> &puzzle, bool solved, long long micros, long long nodes, char *record);
+template <int B>
+void runBatch(int rank, int size, const PuzzleFile &file, const std::string &outPath, int chunkSize, SolverType solver, bool simd, ResultFormat format);
+template <int B>
+long long solveRange(const PuzzleFile &file, long long first, long long count, SolverType solver, bool simd, ResultFormat format, char *records);
+template <int B>
+long long solveLanes(const PuzzleFile &file, long long first, long long count, SolverType solver, ResultFormat format, char *records);
+template <int B>
+void generateCorpus(int rank, int size, long long count, const std::string &outPath);
+template <int B>
+void runService(int rank, int size, const std::string &socketPath, int queueLimit, int chunkSize, SolverType solver, bool simd);
+template <int B>
+void serveRanges(SolverType solver, bool simd);
+void stopService(int signal);
+void packRequests(std::deque<ServiceRequest> &pending, size_t take, int puzzleChars, std::vector<char> &grant, std::vector<ServiceRequest> &taken);
+void answerRequest(std::unordered_map<long long, ServiceConnection> &connections, const ServiceRequest &request, const std::string &line, ServiceMetrics &metrics);
+void readRequests(long long id, int puzzleChars, std::deque<ServiceRequest> &pending, std::unordered_map<long long, ServiceConnection> &connections, ServiceMetrics &metrics);
+std::string serviceStats(const ServiceMetrics &metrics, size_t queued);
+int runClient(const std::string &socketPath);
+template <int B>
+void runPipeline(int rank, int size, int timesToRun, SolverType solver, std::vector<long long> &allCompletionTimes);
+void runBenchmark(int rank, int size, const std::string &corpus, SolverType solver, Schedule schedule, int threads, bool sweep, const std::string &reportPath);
+
+// The 9x9 benchmark sets. The 17 clue puzzles are the first of Gordon Royle's collection,
+// the hard ones are AI Escargot, Arto Inkala's 2012 puzzle, Easter Monster, Golden Nugget
+// and Platinum Blonde. The easy set is generated from BENCH_SEED on.
+const char *const SEVENTEEN_CLUE_PUZZLES[] = {
+    "000000010400000000020000000000050407008000300001090000300400200050100000000806000",
+    "000000010400000000020000000000050604008000300001090000300400200050100000000807000",
+    "000000012000035000000600070700000300000400800100000000000120000080000040050000600",
+    "000000012003600000000007000410020000000500300700000600280000040000300500000000000",
+    "000000012008030000000000040120500000000004700060000000507000300000620000000100000",
+    "000000012040050000000009000070600400000100000000000050000087500601000300200000000",
+    "000000012050400000000000030700600400001000000000080000920000800000510700000003000",
+    "000000012300000060000040000900000500000001070020000000000350400001400800060000000",
+    "000000012400090000000000050070200000600000400000108000018000000000030700502000000",
+    "000000012500008000000700000600120000700000450000030000030000800000500700020000000"};
+const char *const HARD_PUZZLES[] = {
+    "100007090030020008009600500005300900010080002600004000300000010040000007007000300",
+    "800000000003600000070090200050007000000045700000100030001000068008500010090000400",
+    "100000002090400050006000700050903000000070000000850040700000600030009080002000001",
+    "000000039000001005003050800008090006070002000100400000009080050020000600400700000",
+    "000000012000000003002300400001800005060070800000009000008500000900040500470006000"};
+const int EASY_PUZZLES = 50;
+const unsigned BENCH_SEED = 1;
+template <int B>
+long long serveWorker(SolverType solver, int workerQueueSize, std::vector<uint8_t> &grant, std::ostream *costLog, int puzzleNumber, SearchStrategy *strategy = nullptr, std::ostream *solutionsOut = nullptr);
 
-void fillBox(std::vector<int> &puzzle, int boxNum)
+inline int popCount(uint32_t mask)
 {
+    return __builtin_popcount(mask);
+}
+
+inline int popCount(uint64_t mask)
+{
+    return __builtin_popcountll(mask);
+}
+
+// Index of the lowest set bit, which is the smallest digit in the mask minus one.
+inline int lowestBit(uint32_t mask)
+{
+    return __builtin_ctz(mask);
+}
+
+inline int lowestBit(uint64_t mask)
+{
+    return __builtin_ctzll(mask);
+}
+
+// Undo record: the cell's candidates and value before a change.
+template <int B>
+struct TrailEntry
+{
+    int cell;
+    typename Geometry<B>::Mask mask;
+    typename Geometry<B>::Cell value;
+};
+
+// Backtracks between clock reads. Starts small and adapts so that the clock is read
+// a few times per cancelLatency whatever a backtrack costs on this board size.
+thread_local int cancelInterval = 16;
+thread_local int cancelCountdown = 16;
+thread_local std::chrono::steady_clock::time_point lastClockCheck;
+thread_local std::chrono::steady_clock::time_point lastCancelProbe;
+
+// Cheap part of the cancellation check, called on every backtrack. Returns true when
+// cancelLatency has passed since the last probe, so the caller should look for messages.
+inline bool cancelCheckDue()
+{
+    if (--cancelCountdown > 0)
+        return false;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    long long sinceCheck = std::chrono::duration_cast<std::chrono::microseconds>(now - lastClockCheck).count();
+    lastClockCheck = now;
+    if (sinceCheck * 2 > cancelLatency && cancelInterval > 1)
+        cancelInterval /= 2;
+    else if (sinceCheck * 8 < cancelLatency && cancelInterval < 4096)
+        cancelInterval *= 2;
+    cancelCountdown = cancelInterval;
+    if (std::chrono::duration_cast<std::chrono::microseconds>(now - lastCancelProbe).count() < cancelLatency)
+        return false;
+    lastCancelProbe = now;
+    return true;
+}
+
+// Receives the cancellations waiting for a pipelined worker. Those of puzzles it has
+// already left behind are stale and dropped.
+bool pipelineCancelled()
+{
+    int waiting = 0;
+    MPI_Iprobe(0, TAG_CANCEL, MCW, &waiting, MPI_STATUS_IGNORE);
+    while (waiting)
+    {
+        int id;
+        MPI_Recv(&id, sizeof(int), MPI_BYTE, 0, TAG_CANCEL, MCW, MPI_STATUS_IGNORE);
+        if (id == pipelinePuzzle)
+            pipelineStopped = true;
+        MPI_Iprobe(0, TAG_CANCEL, MCW, &waiting, MPI_STATUS_IGNORE);
+    }
+    return pipelineStopped;
+}
+
+// Called by the solvers on every backtrack. Returns true once rank 0 has stopped the puzzle.
+inline bool pollCancel()
+{
+    if (pipelinePuzzle >= 0)
+        return pipelineStopped || (cancelCheckDue() && pipelineCancelled());
+    if (!stopSignal || !cancelCheckDue())
+        return false;
+    int stopped = false;
+    MPI_Test(stopSignal, &stopped, MPI_STATUS_IGNORE);
+    return stopped;
+}
+
+// Board state for the propagating search. Assigned cells keep a single candidate bit.
+// The branching state of every open search level is kept here too, so a work stealing
+// split can hand out the untried values of a level (see splitSearch).
+template <int B>
+struct PropagationBoard
+{
+    typename Geometry<B>::Cell values[Geometry<B>::CELLS];
+    typename Geometry<B>::Mask cand[Geometry<B>::CELLS];
+    std::vector<TrailEntry<B> > trail;
+    bool cancelled;
+    int depth;
+    std::vector<int> levelCell;
+    std::vector<int> levelMark;
+    std::vector<typename Geometry<B>::Mask> levelPending;
+    // Called on every backtrack when set, instead of pollCancel. Returns true to cancel.
+    bool (*poll)(PropagationBoard<B> &board, void *context) = nullptr;
+    void *pollContext = nullptr;
+};
+
+template <int B>
+bool initPropagation(PropagationBoard<B> &board, const Board<B> &puzzle);
+template <int B>
+bool assignValue(PropagationBoard<B> &board, int cell, int value);
+template <int B>
+bool propagate(PropagationBoard<B> &board);
+template <int B>
+void undoTrail(PropagationBoard<B> &board, int mark);
+template <int B>
+int splitSearch(PropagationBoard<B> &board, std::vector<Board<B> > &out);
+template <int B>
+float estimateCost(PropagationBoard<B> &board, const Board<B> &puzzle, std::mt19937 &rng, int probes);
+template <int B>
+bool solvePuzzlePortfolio(Board<B> &puzzle, SearchStrategy &strategy);
+template <int B>
+long long countSolutions(PropagationBoard<B> &board, long long limit, long long &budget, std::ostream *out = nullptr);
+template <int B>
+long long checkUnique(PropagationBoard<B> &board, const Board<B> &puzzle, long long budget);
+template <int B>
+long long generateUnique(Board<B> &puzzle, PropagationBoard<B> &board, std::mt19937 &rng);
+
+// Fresh puzzles generatePuzzle tries at most while looking for one that meets difficultyTarget.
+const int GENERATE_ATTEMPTS = 50;
+// Search nodes one uniqueness check may take at least while removing givens. A removal
+// whose check runs out is undone, so the generator never settles on an undecided puzzle.
+// The finished puzzle can be no harder than this, so with a difficultyTarget each check may
+// take four times the target (see uniqueCheckNodes).
+const long long UNIQUE_CHECK_NODES = 64;
+
+// Search nodes one uniqueness check may take while removing givens.
+long long uniqueCheckNodes()
+{
+    return std::max(UNIQUE_CHECK_NODES, 4 * difficultyTarget);
+}
+
+// Warns on stderr when a generated puzzle is easier than difficultyTarget even after
+// GENERATE_ATTEMPTS tries. difficulty is -1 for the built in puzzle, which has no target.
+void reportShortfall(long long difficulty)
+{
+    if (difficulty >= 0 && difficulty < difficultyTarget)
+        std::cerr << "The hardest of " << GENERATE_ATTEMPTS << " tries takes " << difficulty << " search nodes, short of --difficulty=" << difficultyTarget << ".\n";
+}
+
+template <int B>
+void fillBox(Board<B> &puzzle, int boxNum, std::mt19937 &rng)
+{
+    constexpr int N = Geometry<B>::N;
     std::vector<int> values;
     for (int i = 0; i < N; ++i)
     {
         values.push_back(i);
     }
 
-    std::random_device rd;
-    std::mt19937 g(rd());
-    std::shuffle(values.begin(), values.end(), g);
+    std::shuffle(values.begin(), values.end(), rng);
     int i = 0;
     while (!values.empty())
     {
-        if (getBox(i) == boxNum)
+        if (peerTable<B>.boxOf[i] == boxNum)
         {
             puzzle[i] = values.back() + 1;
             values.pop_back();
@@ -53,11 +910,16 @@ void fillBox(std::vector<int> &puzzle, int boxNum)
     }
 }
 
-// StartingNum must be 17 or higher to get a unique solution
-std::vector<int> generatePuzzle(bool basic)
+// The built in basic puzzles only exist for 9x9, other sizes are always generated.
+// Generated puzzles have exactly one solution and depend on rng alone. With a
+// difficultyTarget the hardest of up to GENERATE_ATTEMPTS tries is kept, and its
+// difficulty is stored in *difficulty when given.
+template <int B>
+Board<B> generatePuzzle(bool basic, std::mt19937 &rng, long long *difficulty)
 {
-    std::vector<int> puzzle(N * N, -1);
-    if (basic)
+    constexpr int N = Geometry<B>::N;
+    Board<B> puzzle(N * N, -1);
+    if (basic && B == 3)
     {
         bool useEasy = false;
         if (useEasy)
@@ -154,141 +1016,389 @@ std::vector<int> generatePuzzle(bool basic)
     }
     else
     {
-        int diagonalSeed = sqrt(N) + 1;
-        for (int i = 0; i < N; ++i)
-        {
-            if (i % diagonalSeed == 0)
-                fillBox(puzzle, i);
-        }
-
-        solvePuzzle(puzzle);
-        std::random_device rd;
-        std::mt19937 eng(rd());
-        std::uniform_int_distribution<> distr(0, (N*N)-1);
-        int startingNum = 17;
-        if(N==16) startingNum = 60;
-        int removeAmount = N*N - startingNum;
-        while (removeAmount > 0)
+        //Keep the hardest of a few tries when there is a difficulty target
+        Board<B> candidate(N * N);
+        PropagationBoard<B> board;
+        long long hardest = -1;
+        for (int attempt = 0; attempt < GENERATE_ATTEMPTS && hardest < difficultyTarget; ++attempt)
         {
-            int removeNum = distr(eng);
-            if (puzzle[removeNum] > 0)
+            long long nodes = generateUnique<B>(candidate, board, rng);
+            if (nodes > hardest)
             {
-                puzzle[removeNum] = -1;
-                removeAmount--;
+                hardest = nodes;
+                puzzle = candidate;
             }
         }
+        if (difficulty)
+            *difficulty = hardest;
     }
 
     return puzzle;
 }
 
-void generateQueue(std::vector<std::vector<int> > &queue, std::vector<int> puzzle)
+// Counts the solutions of a propagated board, stopping at limit, and writes each one to
+// out as a line when given. Every trial placement spends a node of budget, and running out
+// counts as reaching limit. A cancel stops the count early with board.cancelled set.
+template <int B>
+long long countSolutions(PropagationBoard<B> &board, long long limit, long long &budget, std::ostream *out)
 {
-    queue.push_back(puzzle);
-    std::vector<int> currPuzzle;
-    int start = 0;
-    int loops = 0;
-    int currIndex = start;
-    while (puzzle[currIndex] != -1)
-        ++currIndex;
-    while (loops < 3 || (queue.size() < 100 && currIndex < N * N))
+    constexpr int N = Geometry<B>::N;
+    typedef typename Geometry<B>::Mask Mask;
+    int cell = -1;
+    int bestCount = N + 1;
+    for (int i = 0; i < N * N && bestCount > 2; ++i)
+    {
+        if (board.values[i] != -1)
+            continue;
+        int count = popCount(board.cand[i]);
+        if (count < bestCount)
+        {
+            cell = i;
+            bestCount = count;
+        }
+    }
+    if (cell == -1)
     {
-        start = currIndex;
-        int added = queue.size();
-        for (int k = 0; k < added; ++k)
+        if (out)
         {
-            currPuzzle = queue[0];
-            queue.erase(queue.begin());
+            for (int i = 0; i < N * N; ++i)
+                out->put(DIGIT_CHARS[board.values[i] - 1]);
+            out->put('\n');
+        }
+        return 1;
+    }
+
+    int mark = board.trail.size();
+    long long found = 0;
+    Mask options = board.cand[cell];
+    while (options && found < limit && !board.cancelled)
+    {
+        Mask bit = options & (~options + 1);
+        options ^= bit;
+        if (--budget < 0)
+            return limit;
+        if (assignValue<B>(board, cell, lowestBit(bit) + 1) && propagate<B>(board))
+            found += countSolutions<B>(board, limit - found, budget, out);
+        undoTrail<B>(board, mark);
+        STAT_ADD(backtracks, 1);
+        if (pollCancel())
+            board.cancelled = true;
+    }
+    return found;
+}
+
+// Search nodes it takes to prove puzzle has exactly one solution, or -1 if it has none,
+// more than one, or the proof would take more than budget.
+template <int B>
+long long checkUnique(PropagationBoard<B> &board, const Board<B> &puzzle, long long budget)
+{
+    long long left = budget;
+    if (!initPropagation<B>(board, puzzle) || !propagate<B>(board))
+        return -1;
+    if (countSolutions<B>(board, 2, left) != 1 || left < 0)
+        return -1;
+    return budget - left;
+}
+
+// Makes a puzzle with exactly one solution from rng alone. A random solved grid comes
+// from filling the diagonal boxes and solving, then the givens are visited in random
+// order and each one stays removed only if the solution is still unique. The bigger
+// grids stop at a floor of givens so the checks stay cheap. Returns the puzzle's
+// difficulty, the search nodes its uniqueness proof takes.
+template <int B>
+long long generateUnique(Board<B> &puzzle, PropagationBoard<B> &board, std::mt19937 &rng)
+{
+    constexpr int N = Geometry<B>::N;
+    std::fill(puzzle.begin(), puzzle.end(), -1);
+    for (int i = 0; i < N; i += B + 1)
+        fillBox<B>(puzzle, i, rng);
+    solvePuzzlePropagation<B>(puzzle);
+
+    int minGivens = 17;
+    if (N == 16) minGivens = 60;
+    if (N == 25) minGivens = N * N * 2 / 5;
+    if (N == 36) minGivens = N * N * 3 / 5;
+    std::vector<int> order(N * N);
+    for (int i = 0; i < N * N; ++i)
+        order[i] = i;
+    std::shuffle(order.begin(), order.end(), rng);
+    int givens = N * N;
+    const long long budget = uniqueCheckNodes();
+    for (int k = 0; k < N * N && givens > minGivens; ++k)
+    {
+        int cell = order[k];
+        int value = puzzle[cell];
+        puzzle[cell] = -1;
+        if (checkUnique<B>(board, puzzle, budget) < 0)
+            puzzle[cell] = value;
+        else
+            --givens;
+    }
+    return checkUnique<B>(board, puzzle, LLONG_MAX);
+}
 
-            if (k == 0)
+// Expands the puzzle into at least target independent boards for the workers, or as
+// many as there are. The oldest board is always expanded next, on its most constrained
+// cell, so the frontier stays about level. Every child is reduced with propagate, so
+// boards that lead to a contradiction are dropped here instead of being shipped out.
+// Finally each board gets a cost estimate and the frontier is sorted by it.
+template <int B>
+void generateQueue(Frontier<B> &frontier, const Board<B> &puzzle, int target)
+{
+    constexpr int N = Geometry<B>::N;
+    constexpr int CELLS = Geometry<B>::CELLS;
+    typedef typename Geometry<B>::Cell Cell;
+    typedef typename Geometry<B>::Mask Mask;
+    std::vector<Cell> &cells = frontier.cells;
+    cells.clear();
+    PropagationBoard<B> board;
+    if (!initPropagation<B>(board, puzzle) || !propagate<B>(board))
+        return;
+    cells.insert(cells.end(), board.values, board.values + CELLS);
+
+    //cells is a FIFO: boards before head are expanded and get dropped at the end.
+    //Boards propagation already solved go to the front of the frontier.
+    size_t head = 0;
+    std::vector<Cell> solved;
+    Board<B> parent(CELLS);
+    while (head < cells.size() && (int)((cells.size() - head + solved.size()) / CELLS) < target)
+    {
+        std::copy(cells.begin() + head, cells.begin() + head + CELLS, parent.begin());
+        head += CELLS;
+        initPropagation<B>(board, parent);
+
+        int cell = -1;
+        int bestCount = N + 1;
+        for (int i = 0; i < CELLS && bestCount > 2; ++i)
+        {
+            if (board.values[i] != -1)
+                continue;
+            int count = popCount(board.cand[i]);
+            if (count < bestCount)
             {
+                cell = i;
+                bestCount = count;
             }
-            for (int i = 1; i <= N; ++i)
+        }
+        if (cell == -1)
+        {
+            solved.insert(solved.end(), parent.begin(), parent.end());
+            continue;
+        }
+
+        Mask options = board.cand[cell];
+        while (options)
+        {
+            Mask bit = options & (~options + 1);
+            options ^= bit;
+            if (assignValue<B>(board, cell, lowestBit(bit) + 1) && propagate<B>(board))
+                cells.insert(cells.end(), board.values, board.values + CELLS);
+            undoTrail<B>(board, 0);
+        }
+    }
+    cells.erase(cells.begin(), cells.begin() + head);
+    cells.insert(cells.begin(), solved.begin(), solved.end());
+
+    //Estimate every board, then put the most expensive first
+    int count = frontier.size();
+    std::vector<float> cost(count);
+    std::mt19937 rng(count);
+    for (int i = 0; i < count; ++i)
+    {
+        parent.assign(frontier[i], frontier[i] + CELLS);
+        cost[i] = estimateCost<B>(board, parent, rng, costProbes);
+    }
+    std::vector<std::pair<float, int> > order(count);
+    for (int i = 0; i < count; ++i)
+        order[i] = std::make_pair(cost[i], -i);
+    std::sort(order.begin(), order.end(), std::greater<std::pair<float, int> >());
+    std::vector<Cell> sorted(cells.size());
+    frontier.cost.resize(count);
+    for (int i = 0; i < count; ++i)
+    {
+        int from = -order[i].second;
+        std::copy(frontier[from], frontier[from] + CELLS, sorted.begin() + (size_t)i * CELLS);
+        frontier.cost[i] = order[i].first;
+    }
+    cells.swap(sorted);
+}
+
+// Estimated size of the search tree below puzzle, as log2 of a node count. Without probes
+// it is the product of the candidate counts of the open cells, which costs nothing beyond
+// propagating. With probes it is Knuth's estimate: each probe walks one random path down,
+// always branching on the most constrained cell, and sums the products of the branching
+// factors along the way, stopping after N branchings. The mean over the probes is the
+// estimate; paths that hit a contradiction early pull it down.
+template <int B>
+float estimateCost(PropagationBoard<B> &board, const Board<B> &puzzle, std::mt19937 &rng, int probes)
+{
+    constexpr int N = Geometry<B>::N;
+    typedef typename Geometry<B>::Mask Mask;
+    if (!initPropagation<B>(board, puzzle) || !propagate<B>(board))
+        return 0.0f;
+    if (probes == 0)
+    {
+        double bits = 0;
+        for (int i = 0; i < N * N; ++i)
+        {
+            if (board.values[i] == -1)
+                bits += log2((double)popCount(board.cand[i]));
+        }
+        return bits;
+    }
+
+    int mark = board.trail.size();
+    double sum = 0;
+    for (int p = 0; p < probes; ++p)
+    {
+        double product = 1;
+        double nodes = 1;
+        for (int level = 0; level < N; ++level)
+        {
+            int cell = -1;
+            int bestCount = N + 1;
+            for (int i = 0; i < N * N && bestCount > 2; ++i)
             {
-                currPuzzle[currIndex] = i;
-                if (isValid(currPuzzle))
+                if (board.values[i] != -1)
+                    continue;
+                int count = popCount(board.cand[i]);
+                if (count < bestCount)
                 {
-                    queue.push_back(currPuzzle);
+                    cell = i;
+                    bestCount = count;
                 }
             }
+            if (cell == -1)
+                break;
+            product *= bestCount;
+            nodes += product;
+            //Pick one of the candidates uniformly
+            Mask options = board.cand[cell];
+            for (int skip = rng() % bestCount; skip > 0; --skip)
+                options &= options - 1;
+            if (!assignValue<B>(board, cell, lowestBit(options) + 1) || !propagate<B>(board))
+                break;
         }
-        while (queue.back()[currIndex] != -1)
-        {
-            ++currIndex;
-        }
-        ++loops;
+        undoTrail<B>(board, mark);
+        sum += nodes;
     }
+    return log2(sum / probes);
 }
 
 // Gives the box number of the puzzle index.
-// Box numbers increase from
-int getBox(int puzzleIndex)
+// Box numbers increase from left to right, then top to bottom.
+// Only used to build peerTable, the solvers read peerTable<B>.boxOf instead.
+template <int B>
+constexpr int getBox(int puzzleIndex)
 {
-    return (puzzleIndex % N) / box + box * (puzzleIndex / (N * box));
+    return (puzzleIndex % (B * B)) / B + B * (puzzleIndex / (B * B * B));
 }
 
 // Give you the column of the puzzle index
-// Columns start at 0-8
-int getColumn(int puzzleIndex)
+// Columns start at 0-(N-1)
+template <int B>
+constexpr int getColumn(int puzzleIndex)
 {
-    return puzzleIndex % N;
+    return puzzleIndex % (B * B);
 }
 
 // Give you the row of the puzzle index
-// Rows start at 0-8
-int getRow(int puzzleIndex)
+// Rows start at 0-(N-1)
+template <int B>
+constexpr int getRow(int puzzleIndex)
 {
-    return puzzleIndex / N;
+    return puzzleIndex / (B * B);
 }
 
-bool isIndexValid(std::vector<int> &puzzle, int i)
+template <int B>
+constexpr PeerTable<B> buildPeerTable()
 {
-    //Row is all indices in [Nx(i/3), +N]
-    //Values in row are found by adding 1, modulus N, then adding to get back to the correct row if necessary
-    int row = getRow(i);
-    for (int j = (i + 1) % N + (N * row); j != i; j = ((++j) % N) + (N * row))
+    constexpr int N = B * B;
+    PeerTable<B> table{};
+    for (int i = 0; i < N * N; ++i)
     {
-        if (puzzle[j] == -1)
-            continue;
-        if (puzzle[i] == puzzle[j])
+        table.rowOf[i] = getRow<B>(i);
+        table.colOf[i] = getColumn<B>(i);
+        table.boxOf[i] = getBox<B>(i);
+    }
+    for (int u = 0; u < N; ++u)
+    {
+        for (int j = 0; j < N; ++j)
         {
-            return false;
+            table.units[u][j] = u * N + j;
+            table.units[N + u][j] = j * N + u;
+            table.units[2 * N + u][j] = (u / B * B + j / B) * N + u % B * B + j % B;
         }
     }
-
-    //Values in column are found by adding/subtracting N
-    for (int j = (i + N) % (N * N); j != i; j = (j + N) % (N * N))
+    for (int i = 0; i < N * N; ++i)
     {
-        if (puzzle[j] == -1)
-            continue;
-        if (puzzle[i] == puzzle[j])
+        int count = 0;
+        for (int j = 0; j < N; ++j)
         {
-            return false;
+            int rowCell = table.units[table.rowOf[i]][j];
+            int colCell = table.units[N + table.colOf[i]][j];
+            if (rowCell != i)
+                table.peers[i][count++] = rowCell;
+            if (colCell != i)
+                table.peers[i][count++] = colCell;
+        }
+        for (int j = 0; j < N; ++j)
+        {
+            int boxCell = table.units[2 * N + table.boxOf[i]][j];
+            if (table.rowOf[boxCell] != table.rowOf[i] && table.colOf[boxCell] != table.colOf[i])
+                table.peers[i][count++] = boxCell;
         }
     }
-
-    //Values in box are found by finding the minimum and maxiumum possible index that could share a box, and iterating from there.
-    int currBox = getBox(i);
-    int start = i - (N * box) - box;
-    start = (start < 0) ? 0 : start;
-    int end = i + (N * box) + box;
-    end = (end < N * N) ? end : N * N;
-    for (int j = start; j < end; ++j)
+    //Intersections: every row with the boxes it crosses, then every column likewise
+    int k = 0;
+    for (int line = 0; line < 2 * N; ++line)
     {
-        int jBox = getBox(j);
-        if (j != i && puzzle[j] != -1 && jBox == currBox)
+        for (int segment = 0; segment < B; ++segment)
         {
-            if (puzzle[i] == puzzle[j])
+            int b = table.boxOf[table.units[line][segment * B]];
+            int lineCount = 0, boxCount = 0;
+            for (int j = 0; j < N; ++j)
             {
-                return false;
+                if (j / B == segment)
+                    table.intersection[k][j % B] = table.units[line][j];
+                else
+                    table.lineRest[k][lineCount++] = table.units[line][j];
+            }
+            for (int j = 0; j < N; ++j)
+            {
+                int cell = table.units[2 * N + b][j];
+                bool onLine = line < N ? table.rowOf[cell] == line : table.colOf[cell] == line - N;
+                if (!onLine)
+                    table.boxRest[k][boxCount++] = cell;
             }
+            ++k;
+        }
+    }
+    return table;
+}
+
+// Checks cell i against the rest of its row, column and box.
+template <int B>
+bool isIndexValid(const Board<B> &puzzle, int i)
+{
+    constexpr int PEERS = Geometry<B>::PEERS;
+    const short *peers = peerTable<B>.peers[i];
+    for (int j = 0; j < PEERS; ++j)
+    {
+        if (puzzle[peers[j]] == -1)
+            continue;
+        if (puzzle[i] == puzzle[peers[j]])
+        {
+            return false;
         }
     }
     return true;
 }
 
-bool isValid(std::vector<int> puzzle)
+template <int B>
+bool isValid(const Board<B> &puzzle)
 {
+    constexpr int N = Geometry<B>::N;
     //iterate over all values
     for (int i = 0; i < N * N; ++i)
     {
@@ -297,7 +1407,7 @@ bool isValid(std::vector<int> puzzle)
         {
             continue;
         }
-        if (!isIndexValid(puzzle, i))
+        if (!isIndexValid<B>(puzzle, i))
         {
             return false;
         }
@@ -316,59 +1426,83 @@ int getWidth(int n)
         return 3;
     return 0;
 }
-void printPuzzle(std::vector<int> puzzle)
+
+// Prints a board on one line as in the batch format, or as a bordered grid with --grids.
+template <int B>
+void printPuzzle(const Board<B> &puzzle)
 {
+    constexpr int N = Geometry<B>::N;
+    if (!printGrids)
+    {
+        char line[Geometry<B>::CELLS + 1];
+        formatPuzzle<B>(puzzle, line);
+        std::cout.write(line, sizeof(line));
+        return;
+    }
     int w = getWidth(N);
-    int rowLength = N * 2 + box + (N - 9);
-
-    bool overNine = (w - 1);
+    int rowLength = N * (w + 1) + B;
 
-    std::cout << " " << std::string(rowLength, '=') << std::endl;
-    for (int i = 0; i < puzzle.size();)
+    std::cout << " " << std::string(rowLength, '=') << '\n';
+    for (int i = 0; i < (int)puzzle.size();)
     {
-        for (int j = 0; j < box; ++j)
+        for (int j = 0; j < B; ++j)
         {
-            for (int k = 0; k < box; ++k)
+            for (int k = 0; k < B; ++k)
             {
                 std::cout << "|";
-                for (int l = 0; l < box; ++l)
+                for (int l = 0; l < B; ++l)
                 {
                     if (puzzle[i] == -1)
                         std::cout << "|" << std::setw(w) << "*";
                     else
-                        std::cout << "|" << std::setw(w) << puzzle[i];
+                        std::cout << "|" << std::setw(w) << (int)puzzle[i];
                     ++i;
                 }
             }
-            std::cout << "||" << std::endl;
+            std::cout << "||\n";
         }
-        std::cout << " " << std::string(rowLength, '=') << std::endl;
+        std::cout << " " << std::string(rowLength, '=') << '\n';
     }
 }
 
 void report(std::vector<long long> allCompletionTimes){
-    int totalTime = 0;
-    for (int i = 0; i < allCompletionTimes.size(); ++i)
+    if (allCompletionTimes.empty())
+        return;
+    long long totalTime = 0;
+    for (size_t i = 0; i < allCompletionTimes.size(); ++i)
     {
         totalTime += allCompletionTimes[i];
         std::cout << "\nPuzzle number: " << i + 1 << " was solved in " << allCompletionTimes[i] << " microseconds.\n";
     }
 
-    long long averageTime = totalTime / allCompletionTimes.size();
+    long long averageTime = totalTime / (long long)allCompletionTimes.size();
     std::sort(allCompletionTimes.begin(), allCompletionTimes.end());
     std::cout << "\nAll " << allCompletionTimes.size() << " puzzles were solved in a total time of " << totalTime << " microseconds.\n";
     std::cout << "The longest puzzle took " << allCompletionTimes.back() << " microseconds to solve and the shortest taking ";
     std::cout << allCompletionTimes[0] << " microseconds\n";
     std::cout << "With an average time of " << averageTime << " microseconds accross all puzzles.\n";
+    std::cout << "Percentiles: p50 " << percentile(allCompletionTimes, 50) << ", p90 " << percentile(allCompletionTimes, 90);
+    std::cout << ", p99 " << percentile(allCompletionTimes, 99) << " microseconds.\n";
+}
+
+// The p-th percentile of an ascending, non-empty list by nearest rank: the smallest value
+// that at least p percent of the list is at or below, so a tail percentile never reports
+// less than that share of the list actually took.
+long long percentile(const std::vector<long long> &sorted, int p)
+{
+    long long rank = ((long long)sorted.size() * p + 99) / 100;
+    return sorted[std::max(rank, 1LL) - 1];
 }
 
 //I'll give this a return value when it's closer to finished
-bool solvePuzzle(std::vector<int> &puzzle)
+template <int B>
+bool solvePuzzle(Board<B> &puzzle)
 {
-    std::vector<int> queue;
-    int isIncoming = false;
+    constexpr int N = Geometry<B>::N;
+    static thread_local std::vector<int> queue;
+    queue.clear();
     int start = 0;
-    while (puzzle[start] != -1)
+    while (start < N * N && puzzle[start] != -1)
     {
         ++start;
     }
@@ -382,11 +1516,14 @@ bool solvePuzzle(std::vector<int> &puzzle)
             if (queue.size() == 0)
                 break;
             puzzle[queue.back()] = i;
-            if (!isIndexValid(puzzle, queue.back()))
+            ++nodesVisited;
+            STAT_ADD(placements, 1);
+            if (!isIndexValid<B>(puzzle, queue.back()))
             {
                 ++i;
                 while (i > N)
                 {
+                    STAT_ADD(backtracks, 1);
                     puzzle[queue.back()] = -1;
 
                     queue.pop_back();
@@ -395,8 +1532,7 @@ bool solvePuzzle(std::vector<int> &puzzle)
                     else
                         break;
                 }
-                MPI_Iprobe(0, TAG_POISON, MCW, &isIncoming, MPI_STATUS_IGNORE);
-                if(isIncoming){
+                if(pollCancel()){
                     return false;
                 }
             }
@@ -419,233 +1555,4663 @@ bool solvePuzzle(std::vector<int> &puzzle)
     return true;
 }
 
-int main(int argc, char **argv)
+// Free digits for every row, column and box. A set bit means the digit can still be placed there.
+template <int B>
+struct BitmaskBoard
 {
-    int rank, size;
-    std::vector<int> puzzle, puzzle2;
+    typename Geometry<B>::Mask rows[Geometry<B>::N];
+    typename Geometry<B>::Mask cols[Geometry<B>::N];
+    typename Geometry<B>::Mask boxes[Geometry<B>::N];
+};
 
-    MPI_Init(&argc, &argv);
+template <int B>
+inline typename Geometry<B>::Mask getCandidates(const BitmaskBoard<B> &board, int i)
+{
+    STAT_ADD(placements, 1);
+    return board.rows[peerTable<B>.rowOf[i]] & board.cols[peerTable<B>.colOf[i]] & board.boxes[peerTable<B>.boxOf[i]];
+}
+
+// Flips the digit bit in the cell's row, column and box. Used for both placing and removing.
+template <int B>
+inline void toggleDigit(BitmaskBoard<B> &board, int i, typename Geometry<B>::Mask bit)
+{
+    board.rows[peerTable<B>.rowOf[i]] ^= bit;
+    board.cols[peerTable<B>.colOf[i]] ^= bit;
+    board.boxes[peerTable<B>.boxOf[i]] ^= bit;
+}
+
+// Builds the masks from the givens. Returns false if two givens already clash.
+template <int B>
+bool initBitmaskBoard(BitmaskBoard<B> &board, const Board<B> &puzzle)
+{
+    constexpr int N = Geometry<B>::N;
+    typedef typename Geometry<B>::Mask Mask;
+    for (int i = 0; i < N; ++i)
+    {
+        board.rows[i] = Geometry<B>::ALL_DIGITS;
+        board.cols[i] = Geometry<B>::ALL_DIGITS;
+        board.boxes[i] = Geometry<B>::ALL_DIGITS;
+    }
+    for (int i = 0; i < N * N; ++i)
+    {
+        if (puzzle[i] == -1)
+            continue;
+        Mask bit = (Mask)1 << (puzzle[i] - 1);
+        if (!(getCandidates<B>(board, i) & bit))
+            return false;
+        toggleDigit<B>(board, i, bit);
+    }
+    return true;
+}
+
+// Same contract as solvePuzzle, but every placement check is a couple of ANDs on the masks.
+// The next cell is always the empty one with the fewest candidates, and values are taken
+// by walking the set bits of its candidate mask.
+template <int B>
+bool solvePuzzleBitmask(Board<B> &puzzle)
+{
+    constexpr int N = Geometry<B>::N;
+    typedef typename Geometry<B>::Mask Mask;
+    BitmaskBoard<B> board;
+    if (!initBitmaskBoard<B>(board, puzzle))
+        return false;
+
+    //Scratch kept per thread, so repeated solves reuse its storage
+    static thread_local std::vector<int> empty;
+    static thread_local std::vector<Mask> remaining;
+    static thread_local std::vector<int> chosen;
+    empty.clear();
+    for (int i = 0; i < N * N; ++i)
+    {
+        if (puzzle[i] == -1)
+            empty.push_back(i);
+    }
+    int total = empty.size();
+    if (total == 0)
+        return true;
+
+    //remaining[d] holds the untried values for the cell chosen at depth d
+    remaining.assign(total, 0);
+    chosen.assign(total, 0);
+    int depth = 0;
+    bool pickCell = true;
+    while (depth >= 0)
+    {
+        if (pickCell)
+        {
+            //Move the most constrained cell to the front of the unfilled part of empty
+            int best = depth;
+            int bestCount = N + 1;
+            for (int k = depth; k < total; ++k)
+            {
+                int count = popCount(getCandidates<B>(board, empty[k]));
+                if (count < bestCount)
+                {
+                    best = k;
+                    bestCount = count;
+                    if (count <= 1)
+                        break;
+                }
+            }
+            std::swap(empty[depth], empty[best]);
+            chosen[depth] = empty[depth];
+            remaining[depth] = getCandidates<B>(board, chosen[depth]);
+            pickCell = false;
+        }
+
+        int cell = chosen[depth];
+        if (puzzle[cell] != -1)
+        {
+            toggleDigit<B>(board, cell, (Mask)1 << (puzzle[cell] - 1));
+            puzzle[cell] = -1;
+        }
+        if (remaining[depth] == 0)
+        {
+            --depth;
+            STAT_ADD(backtracks, 1);
+            if (pollCancel())
+                return false;
+            continue;
+        }
+
+        Mask bit = remaining[depth] & (~remaining[depth] + 1);
+        remaining[depth] ^= bit;
+        ++nodesVisited;
+        toggleDigit<B>(board, cell, bit);
+        puzzle[cell] = lowestBit(bit) + 1;
+        if (++depth == total)
+            return true;
+        pickCell = true;
+    }
+    return false;
+}
+
+// Algorithm X over the exact cover matrix. Column ids are laid out as
+// [cell | row,digit | column,digit | box,digit], each block N*N wide, and
+// every candidate placement is a matrix row touching exactly one column per block.
+// Node 0 is the root header, nodes 1..4*N*N are the column headers.
+struct DancingLinks
+{
+    std::vector<int> left, right, up, down, column, placement;
+    std::vector<int> size;
+    std::vector<int> solution;
+    bool cancelled;
+};
+
+inline void coverColumn(DancingLinks &dlx, int c)
+{
+    dlx.right[dlx.left[c]] = dlx.right[c];
+    dlx.left[dlx.right[c]] = dlx.left[c];
+    for (int i = dlx.down[c]; i != c; i = dlx.down[i])
+    {
+        for (int j = dlx.right[i]; j != i; j = dlx.right[j])
+        {
+            dlx.down[dlx.up[j]] = dlx.down[j];
+            dlx.up[dlx.down[j]] = dlx.up[j];
+            --dlx.size[dlx.column[j]];
+        }
+    }
+}
+
+inline void uncoverColumn(DancingLinks &dlx, int c)
+{
+    for (int i = dlx.up[c]; i != c; i = dlx.up[i])
+    {
+        for (int j = dlx.left[i]; j != i; j = dlx.left[j])
+        {
+            ++dlx.size[dlx.column[j]];
+            dlx.down[dlx.up[j]] = j;
+            dlx.up[dlx.down[j]] = j;
+        }
+    }
+    dlx.right[dlx.left[c]] = c;
+    dlx.left[dlx.right[c]] = c;
+}
+
+// Gives the four matrix columns (1 based, 0 is the root) covered by placing digit d (0 based) at cell i.
+template <int B>
+inline void placementColumns(int i, int d, int *cols)
+{
+    constexpr int N = Geometry<B>::N;
+    cols[0] = 1 + i;
+    cols[1] = 1 + N * N + peerTable<B>.rowOf[i] * N + d;
+    cols[2] = 1 + 2 * N * N + peerTable<B>.colOf[i] * N + d;
+    cols[3] = 1 + 3 * N * N + peerTable<B>.boxOf[i] * N + d;
+}
+
+// Links up only the columns the givens leave open and only the placements that fit them,
+// so partial frontier boards need no cover calls before the search starts.
+// Returns false if the givens clash.
+template <int B>
+bool buildDancingLinks(DancingLinks &dlx, const Board<B> &puzzle)
+{
+    constexpr int N = Geometry<B>::N;
+    int columns = 4 * N * N;
+    static thread_local std::vector<bool> used;
+    used.assign(columns + 1, false);
+    int cols[4];
+    for (int i = 0; i < N * N; ++i)
+    {
+        if (puzzle[i] == -1)
+            continue;
+        placementColumns<B>(i, puzzle[i] - 1, cols);
+        for (int k = 0; k < 4; ++k)
+        {
+            if (used[cols[k]])
+                return false;
+            used[cols[k]] = true;
+        }
+    }
+
+    dlx.left.assign(columns + 1, 0);
+    dlx.right.assign(columns + 1, 0);
+    dlx.up.resize(columns + 1);
+    dlx.down.resize(columns + 1);
+    dlx.column.resize(columns + 1);
+    dlx.placement.assign(columns + 1, -1);
+    dlx.size.assign(columns + 1, 0);
+    dlx.solution.clear();
+    dlx.cancelled = false;
+
+    int last = 0;
+    for (int c = 0; c <= columns; ++c)
+    {
+        dlx.up[c] = c;
+        dlx.down[c] = c;
+        dlx.column[c] = c;
+        if (c == 0 || used[c])
+            continue;
+        dlx.right[last] = c;
+        dlx.left[c] = last;
+        last = c;
+    }
+    dlx.right[last] = 0;
+    dlx.left[0] = last;
+
+    for (int i = 0; i < N * N; ++i)
+    {
+        if (puzzle[i] != -1)
+            continue;
+        for (int d = 0; d < N; ++d)
+        {
+            placementColumns<B>(i, d, cols);
+            if (used[cols[0]] || used[cols[1]] || used[cols[2]] || used[cols[3]])
+                continue;
+            int first = dlx.left.size();
+            for (int k = 0; k < 4; ++k)
+            {
+                int node = first + k;
+                int c = cols[k];
+                dlx.left.push_back(first + (k + 3) % 4);
+                dlx.right.push_back(first + (k + 1) % 4);
+                dlx.up.push_back(dlx.up[c]);
+                dlx.down.push_back(c);
+                dlx.down[dlx.up[c]] = node;
+                dlx.up[c] = node;
+                dlx.column.push_back(c);
+                dlx.placement.push_back(i * N + d);
+                ++dlx.size[c];
+            }
+        }
+    }
+    return true;
+}
+
+bool searchDancingLinks(DancingLinks &dlx)
+{
+    if (dlx.right[0] == 0)
+        return true;
+
+    //Branch on the column with the fewest remaining rows
+    int c = dlx.right[0];
+    for (int j = dlx.right[c]; j != 0; j = dlx.right[j])
+    {
+        if (dlx.size[j] < dlx.size[c])
+            c = j;
+    }
+    if (dlx.size[c] == 0)
+        return false;
+
+    coverColumn(dlx, c);
+    for (int r = dlx.down[c]; r != c; r = dlx.down[r])
+    {
+        ++nodesVisited;
+        STAT_ADD(placements, 1);
+        dlx.solution.push_back(dlx.placement[r]);
+        for (int j = dlx.right[r]; j != r; j = dlx.right[j])
+            coverColumn(dlx, dlx.column[j]);
+        if (searchDancingLinks(dlx))
+            return true;
+        if (dlx.cancelled)
+            return false;
+        for (int j = dlx.left[r]; j != r; j = dlx.left[j])
+            uncoverColumn(dlx, dlx.column[j]);
+        dlx.solution.pop_back();
+        STAT_ADD(backtracks, 1);
+
+        if (pollCancel())
+        {
+            dlx.cancelled = true;
+            return false;
+        }
+    }
+    uncoverColumn(dlx, c);
+    return false;
+}
+
+// Exact cover solve of a full or partial board. Same contract as solvePuzzle.
+template <int B>
+bool solvePuzzleDancingLinks(Board<B> &puzzle)
+{
+    constexpr int N = Geometry<B>::N;
+    static thread_local DancingLinks dlx;
+    if (!buildDancingLinks<B>(dlx, puzzle))
+        return false;
+    if (!searchDancingLinks(dlx))
+        return false;
+    for (int k = 0; k < (int)dlx.solution.size(); ++k)
+    {
+        puzzle[dlx.solution[k] / N] = dlx.solution[k] % N + 1;
+    }
+    return true;
+}
+
+// Removes a candidate, recording the old state on the trail. Returns false if the cell is left with none.
+template <int B>
+inline bool eliminate(PropagationBoard<B> &board, int cell, typename Geometry<B>::Mask bit)
+{
+    if (!(board.cand[cell] & bit))
+        return true;
+    board.trail.push_back({cell, board.cand[cell], board.values[cell]});
+    board.cand[cell] &= ~bit;
+    return board.cand[cell] != 0;
+}
+
+template <int B>
+bool assignValue(PropagationBoard<B> &board, int cell, int value)
+{
+    constexpr int PEERS = Geometry<B>::PEERS;
+    typedef typename Geometry<B>::Mask Mask;
+    Mask bit = (Mask)1 << (value - 1);
+    STAT_ADD(placements, 1);
+    if (!(board.cand[cell] & bit))
+        return false;
+    board.trail.push_back({cell, board.cand[cell], board.values[cell]});
+    board.values[cell] = value;
+    board.cand[cell] = bit;
+    const short *peers = peerTable<B>.peers[cell];
+    for (int j = 0; j < PEERS; ++j)
+    {
+        if (!eliminate<B>(board, peers[j], bit))
+            return false;
+    }
+    return true;
+}
+
+template <int B>
+void undoTrail(PropagationBoard<B> &board, int mark)
+{
+    while ((int)board.trail.size() > mark)
+    {
+        const TrailEntry<B> &entry = board.trail.back();
+        board.cand[entry.cell] = entry.mask;
+        board.values[entry.cell] = entry.value;
+        board.trail.pop_back();
+    }
+}
+
+// Loads the givens. The trail starts empty, so undoTrail(board, 0) returns to this state.
+template <int B>
+bool initPropagation(PropagationBoard<B> &board, const Board<B> &puzzle)
+{
+    constexpr int N = Geometry<B>::N;
+    board.cancelled = false;
+    board.depth = 0;
+    board.levelCell.resize(N * N);
+    board.levelMark.resize(N * N);
+    board.levelPending.resize(N * N);
+    for (int i = 0; i < N * N; ++i)
+    {
+        board.values[i] = -1;
+        board.cand[i] = Geometry<B>::ALL_DIGITS;
+    }
+    bool ok = true;
+    for (int i = 0; i < N * N && ok; ++i)
+    {
+        if (puzzle[i] != -1)
+            ok = assignValue<B>(board, i, puzzle[i]);
+    }
+    board.trail.clear();
+    return ok;
+}
+
+// Applies naked singles, hidden singles and locked candidates (pointing and box/line
+// reduction) until none of them changes anything. Returns false on a contradiction.
+template <int B>
+bool propagate(PropagationBoard<B> &board)
+{
+    constexpr int N = Geometry<B>::N;
+    typedef typename Geometry<B>::Mask Mask;
+    const PeerTable<B> &table = peerTable<B>;
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+
+        //Naked singles: an empty cell with one candidate left
+        for (int i = 0; i < N * N; ++i)
+        {
+            if (board.values[i] == -1 && popCount(board.cand[i]) == 1)
+            {
+                if (!assignValue<B>(board, i, lowestBit(board.cand[i]) + 1))
+                    return false;
+                changed = true;
+            }
+        }
+        if (changed)
+            continue;
+
+        //Hidden singles: a digit with only one possible cell in a unit
+        for (int u = 0; u < 3 * N; ++u)
+        {
+            Mask once = 0, twice = 0;
+            for (int j = 0; j < N; ++j)
+            {
+                Mask c = board.cand[table.units[u][j]];
+                twice |= once & c;
+                once |= c;
+            }
+            if (once != Geometry<B>::ALL_DIGITS)
+                return false;
+            Mask exactly = once & ~twice;
+            for (int j = 0; j < N && exactly; ++j)
+            {
+                int cell = table.units[u][j];
+                Mask hit = board.cand[cell] & exactly;
+                if (!hit || board.values[cell] != -1)
+                    continue;
+                if (hit & (hit - 1))
+                    return false;
+                if (!assignValue<B>(board, cell, lowestBit(hit) + 1))
+                    return false;
+                changed = true;
+            }
+        }
+        if (changed)
+            continue;
+
+        //Locked candidates: a digit confined to a line/box intersection on one side
+        //can be removed from the other side
+        int before = board.trail.size();
+        for (int k = 0; k < 2 * N * B; ++k)
+        {
+            Mask shared = 0, line = 0, rest = 0;
+            for (int j = 0; j < B; ++j)
+                shared |= board.cand[table.intersection[k][j]];
+            for (int j = 0; j < N - B; ++j)
+            {
+                line |= board.cand[table.lineRest[k][j]];
+                rest |= board.cand[table.boxRest[k][j]];
+            }
+            Mask pointing = shared & ~rest;
+            Mask claiming = shared & ~line;
+            for (int j = 0; j < N - B; ++j)
+            {
+                if (pointing && !eliminate<B>(board, table.lineRest[k][j], pointing))
+                    return false;
+                if (claiming && !eliminate<B>(board, table.boxRest[k][j], claiming))
+                    return false;
+            }
+        }
+        changed = (int)board.trail.size() != before;
+    }
+    return true;
+}
+
+template <int B>
+bool searchPropagation(PropagationBoard<B> &board)
+{
+    constexpr int N = Geometry<B>::N;
+    typedef typename Geometry<B>::Mask Mask;
+    int cell = -1;
+    int bestCount = N + 1;
+    for (int i = 0; i < N * N; ++i)
+    {
+        if (board.values[i] != -1)
+            continue;
+        int count = popCount(board.cand[i]);
+        if (count < bestCount)
+        {
+            cell = i;
+            bestCount = count;
+        }
+    }
+    if (cell == -1)
+        return true;
+
+    //Untried values live in levelPending so a steal can take them away mid loop
+    int d = board.depth;
+    board.levelCell[d] = cell;
+    board.levelMark[d] = board.trail.size();
+    board.levelPending[d] = board.cand[cell];
+    while (board.levelPending[d])
+    {
+        Mask options = board.levelPending[d];
+        Mask bit = options & (~options + 1);
+        board.levelPending[d] ^= bit;
+        ++nodesVisited;
+        ++board.depth;
+        bool found = assignValue<B>(board, cell, lowestBit(bit) + 1) && propagate<B>(board) && searchPropagation<B>(board);
+        --board.depth;
+        if (found)
+            return true;
+        if (board.cancelled)
+            return false;
+        undoTrail<B>(board, board.levelMark[d]);
+        STAT_ADD(backtracks, 1);
+
+        if (board.poll)
+        {
+            if (board.poll(board, board.pollContext))
+            {
+                board.cancelled = true;
+                return false;
+            }
+            continue;
+        }
+        if (pollCancel())
+        {
+            board.cancelled = true;
+            return false;
+        }
+    }
+    return false;
+}
+
+// Takes every untried value of the shallowest open level away from a running search and
+// appends one board per value to out. Those levels hold the biggest unexplored subtrees.
+// Returns the number of boards added.
+template <int B>
+int splitSearch(PropagationBoard<B> &board, std::vector<Board<B> > &out)
+{
+    constexpr int N = Geometry<B>::N;
+    typedef typename Geometry<B>::Mask Mask;
+    for (int level = 0; level < board.depth; ++level)
+    {
+        Mask pending = board.levelPending[level];
+        if (!pending)
+            continue;
+        //Rewind a copy of the values to how they were when this level branched
+        Board<B> state(board.values, board.values + N * N);
+        for (int t = (int)board.trail.size() - 1; t >= board.levelMark[level]; --t)
+            state[board.trail[t].cell] = board.trail[t].value;
+        int count = 0;
+        while (pending)
+        {
+            Mask bit = pending & (~pending + 1);
+            pending ^= bit;
+            state[board.levelCell[level]] = lowestBit(bit) + 1;
+            out.push_back(state);
+            ++count;
+        }
+        board.levelPending[level] = 0;
+        return count;
+    }
+    return 0;
+}
+
+// Propagates the givens to a fixpoint, then searches on the most constrained cell,
+// propagating again after every branch. Same contract as solvePuzzle.
+template <int B>
+bool solvePuzzlePropagation(Board<B> &puzzle)
+{
+    constexpr int N = Geometry<B>::N;
+    //Kept per thread so the trail and level stacks are only sized once
+    static thread_local PropagationBoard<B> board;
+    if (!initPropagation<B>(board, puzzle) || !propagate<B>(board))
+        return false;
+    if (!searchPropagation<B>(board))
+        return false;
+    for (int i = 0; i < N * N; ++i)
+        puzzle[i] = board.values[i];
+    return true;
+}
+
+template <int B>
+bool solveWith(SolverType solver, Board<B> &puzzle)
+{
+    if (solver == SOLVER_PROPAGATE)
+        return solvePuzzlePropagation<B>(puzzle);
+    if (solver == SOLVER_REFERENCE)
+        return solvePuzzle<B>(puzzle);
+    if (solver == SOLVER_DLX)
+        return solvePuzzleDancingLinks<B>(puzzle);
+    return solvePuzzleBitmask<B>(puzzle);
+}
+
+// Strategy of the portfolio racer at index within its group. Index 0 searches exactly like
+// the propagate solver, the next ones change one choice each, and the rest draw random
+// orders from their own seed and restart.
+SearchStrategy makeStrategy(int index)
+{
+    SearchStrategy strategy;
+    strategy.cells = CELL_MRV;
+    strategy.values = VALUE_ASCENDING;
+    strategy.restarts = false;
+    strategy.rng.seed(index);
+    if (index == 0)
+        snprintf(strategy.name, sizeof(strategy.name), "most constrained cell, ascending values");
+    else if (index == 1)
+    {
+        strategy.values = VALUE_DESCENDING;
+        snprintf(strategy.name, sizeof(strategy.name), "most constrained cell, descending values");
+    }
+    else if (index == 2)
+    {
+        strategy.cells = CELL_MRV_DEGREE;
+        snprintf(strategy.name, sizeof(strategy.name), "most constrained cell by degree, ascending values");
+    }
+    else
+    {
+        strategy.cells = CELL_MRV_RANDOM;
+        strategy.values = VALUE_RANDOM;
+        strategy.restarts = index % 2 == 1;
+        snprintf(strategy.name, sizeof(strategy.name), "random ties and values, seed %d%s", index, strategy.restarts ? ", restarts" : "");
+    }
+    return strategy;
+}
+
+// Picks the next value to try from the untried ones, as one bit of pending.
+template <int B>
+typename Geometry<B>::Mask pickValue(typename Geometry<B>::Mask pending, SearchStrategy &strategy)
+{
+    if (strategy.values == VALUE_DESCENDING)
+    {
+        while (pending & (pending - 1))
+            pending &= pending - 1;
+        return pending;
+    }
+    if (strategy.values == VALUE_RANDOM)
+    {
+        for (int skip = strategy.rng() % popCount(pending); skip > 0; --skip)
+            pending &= pending - 1;
+    }
+    return pending & (~pending + 1);
+}
+
+// Empty cells among the peers of cell, the degree heuristic's measure of how much a
+// placement there constrains the rest of the board.
+template <int B>
+int openPeers(const PropagationBoard<B> &board, int cell)
+{
+    int open = 0;
+    const short *peers = peerTable<B>.peers[cell];
+    for (int j = 0; j < Geometry<B>::PEERS; ++j)
+        open += board.values[peers[j]] == -1;
+    return open;
+}
+
+// searchPropagation with the branching choices of a strategy. Every trial placement
+// spends one node of budget, and the search gives up once it runs out. Both giving up
+// and a cancel leave board.cancelled set; budget tells them apart.
+template <int B>
+bool searchPortfolio(PropagationBoard<B> &board, SearchStrategy &strategy, long long &budget)
+{
+    constexpr int N = Geometry<B>::N;
+    typedef typename Geometry<B>::Mask Mask;
+    int cell = -1;
+    int bestCount = N + 1;
+    int bestDegree = -1;
+    int ties = 0;
+    for (int i = 0; i < N * N; ++i)
+    {
+        if (board.values[i] != -1)
+            continue;
+        int count = popCount(board.cand[i]);
+        if (count < bestCount)
+        {
+            cell = i;
+            bestCount = count;
+            ties = 1;
+            if (strategy.cells == CELL_MRV_DEGREE)
+                bestDegree = openPeers<B>(board, i);
+        }
+        else if (count == bestCount && strategy.cells == CELL_MRV_DEGREE)
+        {
+            int degree = openPeers<B>(board, i);
+            if (degree > bestDegree)
+            {
+                cell = i;
+                bestDegree = degree;
+            }
+        }
+        else if (count == bestCount && strategy.cells == CELL_MRV_RANDOM)
+        {
+            //Reservoir sampling keeps each tied cell equally likely
+            if (strategy.rng() % ++ties == 0)
+                cell = i;
+        }
+    }
+    if (cell == -1)
+        return true;
+
+    int mark = board.trail.size();
+    Mask pending = board.cand[cell];
+    while (pending)
+    {
+        Mask bit = pickValue<B>(pending, strategy);
+        pending ^= bit;
+        if (--budget < 0)
+        {
+            board.cancelled = true;
+            return false;
+        }
+        ++nodesVisited;
+        bool found = assignValue<B>(board, cell, lowestBit(bit) + 1) && propagate<B>(board) && searchPortfolio<B>(board, strategy, budget);
+        if (found)
+            return true;
+        if (board.cancelled)
+            return false;
+        undoTrail<B>(board, mark);
+        STAT_ADD(backtracks, 1);
+        if (pollCancel())
+        {
+            board.cancelled = true;
+            return false;
+        }
+    }
+    return false;
+}
+
+// Solves a board with one portfolio strategy. With restarts the search starts over with
+// fresh random choices each time it uses up its node cutoff, which doubles every time, so
+// an unlucky early choice cannot trap it. Same contract as solvePuzzle.
+template <int B>
+bool solvePuzzlePortfolio(Board<B> &puzzle, SearchStrategy &strategy)
+{
+    constexpr int N = Geometry<B>::N;
+    static thread_local PropagationBoard<B> board;
+    if (!initPropagation<B>(board, puzzle) || !propagate<B>(board))
+        return false;
+    int start = board.trail.size();
+    long long cutoff = strategy.restarts ? N * N : LLONG_MAX;
+    while (true)
+    {
+        long long budget = cutoff;
+        board.cancelled = false;
+        if (searchPortfolio<B>(board, strategy, budget))
+            break;
+        //A cancel or a fully searched tree is final, only a used up cutoff restarts
+        if (budget >= 0)
+            return false;
+        undoTrail<B>(board, start);
+        cutoff *= 2;
+    }
+    for (int i = 0; i < N * N; ++i)
+        puzzle[i] = board.values[i];
+    return true;
+}
+
+// Packed boards start with one of these format bytes.
+// Dense boards store every cell in VALUE_BITS bits, 0 meaning empty. Sparse boards store
+// an N*N bit map of the filled cells followed by VALUE_BITS per filled cell, which is
+// smaller for frontier boards that are still mostly empty.
+const uint8_t PACK_DENSE = 0;
+const uint8_t PACK_SPARSE = 1;
+
+inline void writeBits(uint8_t *out, int &bit, unsigned value, int bits)
+{
+    for (int b = 0; b < bits; ++b, ++bit)
+    {
+        if ((value >> b) & 1)
+            out[bit >> 3] |= 1 << (bit & 7);
+    }
+}
+
+inline unsigned readBits(const uint8_t *in, int &bit, int bits)
+{
+    unsigned value = 0;
+    for (int b = 0; b < bits; ++b, ++bit)
+        value |= ((in[bit >> 3] >> (bit & 7)) & 1u) << b;
+    return value;
+}
+
+// Writes the board to out, which needs MAX_PACKED_BYTES of space. Returns the bytes used.
+template <int B>
+int packBoard(const typename Geometry<B>::Cell *puzzle, uint8_t *out)
+{
+    constexpr int CELLS = Geometry<B>::CELLS;
+    constexpr int VALUE_BITS = Geometry<B>::VALUE_BITS;
+    int givens = 0;
+    for (int i = 0; i < CELLS; ++i)
+        givens += puzzle[i] != -1;
+    int denseBytes = (CELLS * VALUE_BITS + 7) / 8;
+    int sparseBytes = (CELLS + givens * VALUE_BITS + 7) / 8;
+    bool sparse = sparseBytes < denseBytes;
+    int bytes = sparse ? sparseBytes : denseBytes;
+
+    out[0] = sparse ? PACK_SPARSE : PACK_DENSE;
+    uint8_t *body = out + 1;
+    std::fill(body, body + bytes, 0);
+    int bit = 0;
+    if (sparse)
+    {
+        for (int i = 0; i < CELLS; ++i)
+            writeBits(body, bit, puzzle[i] != -1, 1);
+    }
+    for (int i = 0; i < CELLS; ++i)
+    {
+        if (!sparse || puzzle[i] != -1)
+            writeBits(body, bit, puzzle[i] == -1 ? 0 : puzzle[i], VALUE_BITS);
+    }
+    return 1 + bytes;
+}
+
+// Reads a board written by packBoard. Returns the bytes consumed.
+template <int B>
+int unpackBoard(const uint8_t *in, Board<B> &puzzle)
+{
+    constexpr int CELLS = Geometry<B>::CELLS;
+    constexpr int VALUE_BITS = Geometry<B>::VALUE_BITS;
+    const uint8_t *body = in + 1;
+    int bit = 0;
+    if (in[0] == PACK_SPARSE)
+    {
+        int givens = 0;
+        for (int i = 0; i < CELLS; ++i)
+        {
+            puzzle[i] = readBits(body, bit, 1) ? 0 : -1;
+            givens += puzzle[i] == 0;
+        }
+        for (int i = 0; i < CELLS; ++i)
+        {
+            if (puzzle[i] == 0)
+                puzzle[i] = readBits(body, bit, VALUE_BITS);
+        }
+        return 1 + (CELLS + givens * VALUE_BITS + 7) / 8;
+    }
+    for (int i = 0; i < CELLS; ++i)
+    {
+        int value = readBits(body, bit, VALUE_BITS);
+        puzzle[i] = value == 0 ? -1 : value;
+    }
+    return 1 + (CELLS * VALUE_BITS + 7) / 8;
+}
+
+template <int B>
+int packBoard(const Board<B> &puzzle, uint8_t *out)
+{
+    return packBoard<B>(puzzle.data(), out);
+}
+
+// Packs queue[first, first + quantity) into buffer as a grant: the quantity as an int,
+// then the packed boards back to back, then a float cost estimate per board (0 when
+// unknown). Returns the bytes used.
+template <int B>
+int packGrant(const std::vector<Board<B> > &queue, int first, int quantity, std::vector<uint8_t> &buffer)
+{
+    buffer.resize(sizeof(int) + (size_t)quantity * Geometry<B>::MAX_GRANT_ENTRY_BYTES);
+    memcpy(buffer.data(), &quantity, sizeof(int));
+    int bytes = sizeof(int);
+    for (int j = 0; j < quantity; ++j)
+        bytes += packBoard<B>(queue[first + j], buffer.data() + bytes);
+    memset(buffer.data() + bytes, 0, quantity * sizeof(float));
+    return bytes + quantity * sizeof(float);
+}
+
+// Same grant layout, straight from the frontier buffer.
+template <int B>
+int packGrant(const Frontier<B> &frontier, int first, int quantity, std::vector<uint8_t> &buffer)
+{
+    buffer.resize(sizeof(int) + (size_t)quantity * Geometry<B>::MAX_GRANT_ENTRY_BYTES);
+    memcpy(buffer.data(), &quantity, sizeof(int));
+    int bytes = sizeof(int);
+    for (int j = 0; j < quantity; ++j)
+        bytes += packBoard<B>(frontier[first + j], buffer.data() + bytes);
+    memcpy(buffer.data() + bytes, frontier.cost.data() + first, quantity * sizeof(float));
+    return bytes + quantity * sizeof(float);
+}
+
+// Sends frontier[first, first + quantity) to dest as one TAG_GRANT message.
+template <int B>
+void sendGrant(const Frontier<B> &frontier, int first, int quantity, int dest, std::vector<uint8_t> &buffer)
+{
+    int bytes = packGrant<B>(frontier, first, quantity, buffer);
+    MPI_Send(buffer.data(), bytes, MPI_BYTE, dest, TAG_GRANT, MCW);
+}
+
+// Unpacks a received grant onto the end of queue, and its cost estimates into estimates
+// when given. Returns the number of boards.
+template <int B>
+int receiveGrant(const std::vector<uint8_t> &buffer, std::vector<Board<B> > &queue, std::vector<float> *estimates)
+{
+    int quantity;
+    memcpy(&quantity, buffer.data(), sizeof(int));
+    STAT_ADD(boards, quantity);
+    //Unpack straight into the new slots, a queue with room for them does not allocate
+    size_t first = queue.size();
+    queue.resize(first + quantity);
+    int offset = sizeof(int);
+    for (int j = 0; j < quantity; ++j)
+        offset += unpackBoard<B>(buffer.data() + offset, queue[first + j]);
+    if (estimates)
+    {
+        estimates->resize(quantity);
+        memcpy(estimates->data(), buffer.data() + offset, quantity * sizeof(float));
+    }
+    return quantity;
+}
+
+// Receives and throws away anything still addressed to this rank, whatever its size.
+void drainMessages()
+{
+    int t = 0, bytes = 0;
+    std::vector<char> junk;
+    MPI_Status cleanup;
+    MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MCW, &t, &cleanup);
+    while (t)
+    {
+        MPI_Get_count(&cleanup, MPI_BYTE, &bytes);
+        junk.resize(std::max(bytes, 1));
+        MPI_Recv(junk.data(), bytes, MPI_BYTE, cleanup.MPI_SOURCE, cleanup.MPI_TAG, MCW, MPI_STATUS_IGNORE);
+        MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MCW, &t, &cleanup);
+    }
+}
+
+// Nonblocking synchronous sends still in flight. An Issend only completes once the
+// receiver has matched it, so an empty outbox means nothing this rank sent is in transit.
+// Buffers of completed sends go to spare and are refilled by later sends, so an outbox
+// that is kept around stops allocating.
+struct Outbox
+{
+    std::vector<MPI_Request> requests;
+    std::vector<std::vector<uint8_t> > buffers;
+    std::vector<std::vector<uint8_t> > spare;
+};
+
+void postSend(Outbox &outbox, const void *data, int bytes, int dest, int tag)
+{
+    const uint8_t *begin = (const uint8_t *)data;
+    if (outbox.spare.empty())
+    {
+        outbox.buffers.emplace_back();
+    }
+    else
+    {
+        outbox.buffers.push_back(std::move(outbox.spare.back()));
+        outbox.spare.pop_back();
+    }
+    outbox.buffers.back().assign(begin, begin + bytes);
+    outbox.requests.push_back(MPI_REQUEST_NULL);
+    MPI_Issend(outbox.buffers.back().data(), bytes, MPI_BYTE, dest, tag, MCW, &outbox.requests.back());
+}
+
+// Forgets the sends that have completed.
+void reapSends(Outbox &outbox)
+{
+    for (int i = (int)outbox.requests.size() - 1; i >= 0; --i)
+    {
+        int complete = 0;
+        MPI_Test(&outbox.requests[i], &complete, MPI_STATUS_IGNORE);
+        if (complete)
+        {
+            outbox.spare.push_back(std::move(outbox.buffers[i]));
+            outbox.requests.erase(outbox.requests.begin() + i);
+            outbox.buffers.erase(outbox.buffers.begin() + i);
+        }
+    }
+}
+
+// Called by every rank once it has stopped. Throws away whatever arrives until this rank's
+// own sends are matched, then joins a nonblocking barrier and keeps discarding until all
+// ranks are in it. Afterwards no message of the finished puzzle is left in flight.
+void quiesce(Outbox &outbox)
+{
+    MPI_Request barrier = MPI_REQUEST_NULL;
+    bool barrierPosted = false;
+    int barrierDone = 0;
+    while (!barrierDone)
+    {
+        drainMessages();
+        if (!barrierPosted)
+        {
+            reapSends(outbox);
+            if (outbox.requests.empty())
+            {
+                MPI_Ibarrier(MCW, &barrier);
+                barrierPosted = true;
+            }
+        }
+        else
+        {
+            MPI_Test(&barrier, &barrierDone, MPI_STATUS_IGNORE);
+        }
+    }
+}
+
+// Per-worker state of the work stealing scheduler. Termination is detected with Safra's
+// token ring over the workers: counter is steal replies with work sent minus received,
+// and black marks a worker that received work since it last passed the token.
+template <int B>
+struct StealContext
+{
+    int rank;
+    int size;
+    std::vector<Board<B> > work;
+    PropagationBoard<B> *active = nullptr;
+    Outbox outbox;
+    std::mt19937 rng;
+    std::vector<uint8_t> buffer;
+    std::vector<uint8_t> reply;
+    bool stopped = false;
+    bool requestOutstanding = false;
+    bool holdingToken = false;
+    bool tokenStarted = false;
+    int tokenCount = 0;
+    bool tokenBlack = false;
+    bool black = false;
+    int counter = 0;
+};
+
+// Handles one message of the stealing protocol. Work for a thief comes from the front of
+// the local queue first and otherwise from the shallowest open level of the running search.
+template <int B>
+void handleStealMessage(StealContext<B> &ctx, const MPI_Status &status)
+{
+    int bytes = 0;
+    MPI_Get_count(&status, MPI_BYTE, &bytes);
+    ctx.buffer.resize(std::max(bytes, (int)sizeof(int)));
+    MPI_Recv(ctx.buffer.data(), bytes, MPI_BYTE, status.MPI_SOURCE, status.MPI_TAG, MCW, MPI_STATUS_IGNORE);
+
+    if (status.MPI_TAG == TAG_STEAL_REQUEST)
+    {
+        static std::vector<Board<B> > loot;
+        loot.clear();
+        int share = (ctx.work.size() + 1) / 2;
+        if (share > 0)
+        {
+            loot.assign(ctx.work.begin(), ctx.work.begin() + share);
+            ctx.work.erase(ctx.work.begin(), ctx.work.begin() + share);
+        }
+        else if (ctx.active)
+        {
+            splitSearch<B>(*ctx.active, loot);
+        }
+        int replyBytes = packGrant<B>(loot, 0, loot.size(), ctx.reply);
+        TRACE_INSTANT("steal reply sent", loot.size());
+        postSend(ctx.outbox, ctx.reply.data(), replyBytes, status.MPI_SOURCE, TAG_STEAL_REPLY);
+        if (!loot.empty())
+            ++ctx.counter;
+    }
+    else if (status.MPI_TAG == TAG_STEAL_REPLY)
+    {
+        ctx.requestOutstanding = false;
+        int received = receiveGrant<B>(ctx.buffer, ctx.work);
+        TRACE_INSTANT("steal reply", received);
+        if (received > 0)
+        {
+            --ctx.counter;
+            ctx.black = true;
+        }
+    }
+    else if (status.MPI_TAG == TAG_TOKEN)
+    {
+        int token[2];
+        memcpy(token, ctx.buffer.data(), sizeof(token));
+        ctx.holdingToken = true;
+        ctx.tokenCount = token[0];
+        ctx.tokenBlack = token[1];
+    }
+    else if (status.MPI_TAG == TAG_STOP)
+    {
+        ctx.stopped = true;
+    }
+}
+
+// Handles everything waiting for this worker. Returns true once it has been told to stop.
+template <int B>
+bool pollSteal(StealContext<B> &ctx)
+{
+    int isIncoming = 0;
+    MPI_Status status;
+    reapSends(ctx.outbox);
+    MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MCW, &isIncoming, &status);
+    while (isIncoming && !ctx.stopped)
+    {
+        handleStealMessage<B>(ctx, status);
+        MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MCW, &isIncoming, &status);
+    }
+    return ctx.stopped;
+}
+
+template <int B>
+bool pollStealSearch(PropagationBoard<B> &board, void *context)
+{
+    if (!cancelCheckDue())
+        return false;
+    return pollSteal<B>(*(StealContext<B> *)context);
+}
+
+// Moves the token on while idle. Rank 1 starts every wave and decides: a white token
+// coming back to a white initiator with a zero message balance means every worker is
+// idle with nothing in flight, so the puzzle has no solution left to find.
+template <int B>
+void passToken(StealContext<B> &ctx)
+{
+    int next = ctx.rank + 1 < ctx.size ? ctx.rank + 1 : 1;
+    int token[2];
+    if (ctx.rank == 1)
+    {
+        if (ctx.tokenStarted && !ctx.holdingToken)
+            return;
+        if (ctx.holdingToken && !ctx.tokenBlack && !ctx.black && ctx.tokenCount + ctx.counter == 0)
+        {
+            int inc = 0;
+            for (int i = 2; i < ctx.size; ++i)
+                postSend(ctx.outbox, &inc, sizeof(int), i, TAG_STOP);
+            postSend(ctx.outbox, &inc, sizeof(int), 0, TAG_DONE);
+            ctx.stopped = true;
+            return;
+        }
+        token[0] = 0;
+        token[1] = 0;
+        ctx.tokenStarted = true;
+    }
+    else
+    {
+        if (!ctx.holdingToken)
+            return;
+        token[0] = ctx.tokenCount + ctx.counter;
+        token[1] = ctx.tokenBlack || ctx.black;
+    }
+    ctx.holdingToken = false;
+    ctx.black = false;
+    postSend(ctx.outbox, token, sizeof(token), next, TAG_TOKEN);
+}
+
+// Worker side of --schedule=steal. Solves its own boards newest first with the propagating
+// search and, once out of work, asks random workers for some. Returns true if this worker
+// found the solution, which it has then sent to rank 0.
+template <int B>
+bool stealWork(int rank, int size, std::vector<Board<B> > &seed)
+{
+    constexpr int N = Geometry<B>::N;
+    StealContext<B> ctx;
+    ctx.rank = rank;
+    ctx.size = size;
+    ctx.work.swap(seed);
+    ctx.rng.seed(std::chrono::steady_clock::now().time_since_epoch().count() + rank);
+    std::uniform_int_distribution<int> victims(1, std::max(size - 2, 1));
+    int backoff = 10;
+    bool found = false;
+
+    while (!ctx.stopped)
+    {
+        if (!ctx.work.empty())
+        {
+            //Kept from board to board and puzzle to puzzle, like the master schedule's scratch
+            static PropagationBoard<B> board;
+            board.poll = pollStealSearch<B>;
+            board.pollContext = &ctx;
+            Board<B> puzzle = ctx.work.back();
+            ctx.work.pop_back();
+            ctx.active = &board;
+            {
+                TRACE_SPAN(solveSpan, "solve");
+                found = initPropagation<B>(board, puzzle) && propagate<B>(board) && searchPropagation<B>(board);
+            }
+            ctx.active = nullptr;
+            if (found)
+            {
+                for (int i = 0; i < N * N; ++i)
+                    puzzle[i] = board.values[i];
+                std::vector<uint8_t> packed(Geometry<B>::MAX_PACKED_BYTES);
+                int bytes = packBoard<B>(puzzle, packed.data());
+                postSend(ctx.outbox, packed.data(), bytes, 0, TAG_SOLVED);
+                int inc = 0;
+                for (int i = 1; i < size; ++i)
+                {
+                    if (i != rank)
+                        postSend(ctx.outbox, &inc, sizeof(int), i, TAG_STOP);
+                }
+                ctx.stopped = true;
+                break;
+            }
+            pollSteal<B>(ctx);
+            continue;
+        }
+
+        //Idle: pass the token on, then steal from a random worker, backing off while nobody has any
+        passToken<B>(ctx);
+        if (ctx.stopped)
+            break;
+        if (!ctx.requestOutstanding && size > 2)
+        {
+            int victim = victims(ctx.rng);
+            if (victim >= rank)
+                ++victim;
+            int inc = 0;
+            TRACE_INSTANT("steal request", victim);
+            postSend(ctx.outbox, &inc, sizeof(int), victim, TAG_STEAL_REQUEST);
+            ctx.requestOutstanding = true;
+        }
+        bool wasWaiting = ctx.requestOutstanding;
+        pollSteal<B>(ctx);
+        if (!ctx.work.empty())
+        {
+            backoff = 10;
+        }
+        else
+        {
+            STAT_TIMER(idleTimer, idleMicros);
+            usleep(wasWaiting && !ctx.requestOutstanding ? backoff : 20);
+            if (wasWaiting && !ctx.requestOutstanding)
+                backoff = std::min(backoff * 2, 1000);
+        }
+    }
+    quiesce(ctx.outbox);
+    return found;
+}
+
+// One board of a WorkDeque, held as atomic words. A thief may read a slot while the owner
+// refills it, and relaxed word-wise copies keep that a benign race instead of undefined
+// behaviour; the deque's claim on top decides whether the copy is kept.
+template <int B>
+struct DequeSlot
+{
+    static const int WORDS = sizeof(Board<B>) / sizeof(uint64_t);
+    std::atomic<uint64_t> words[WORDS];
+};
+
+template <int B>
+void storeSlot(DequeSlot<B> &slot, const Board<B> &board)
+{
+    uint64_t raw[DequeSlot<B>::WORDS];
+    memcpy(raw, &board, sizeof(raw));
+    for (int i = 0; i < DequeSlot<B>::WORDS; ++i)
+        slot.words[i].store(raw[i], std::memory_order_relaxed);
+}
+
+template <int B>
+void loadSlot(const DequeSlot<B> &slot, Board<B> &board)
+{
+    uint64_t raw[DequeSlot<B>::WORDS];
+    for (int i = 0; i < DequeSlot<B>::WORDS; ++i)
+        raw[i] = slot.words[i].load(std::memory_order_relaxed);
+    memcpy(&board, raw, sizeof(raw));
+}
+
+// Bounded Chase-Lev deque of boards. The owning thread pushes and pops at the bottom,
+// the other threads of the rank steal from the top, all without locks. The slots hold
+// the boards by value, so nothing is allocated per board.
+template <int B>
+struct WorkDeque
+{
+    static const long CAPACITY = 1024;
+    DequeSlot<B> slots[CAPACITY];
+    std::atomic<long> top{0};
+    std::atomic<long> bottom{0};
+};
+
+// Owner only. Returns false when the deque is full.
+template <int B>
+bool dequePush(WorkDeque<B> &deque, const Board<B> &board)
+{
+    long b = deque.bottom.load(std::memory_order_relaxed);
+    long t = deque.top.load(std::memory_order_acquire);
+    if (b - t >= WorkDeque<B>::CAPACITY)
+        return false;
+    storeSlot<B>(deque.slots[b % WorkDeque<B>::CAPACITY], board);
+    deque.bottom.store(b + 1, std::memory_order_release);
+    return true;
+}
+
+// Owner only.
+template <int B>
+bool dequePop(WorkDeque<B> &deque, Board<B> &board)
+{
+    long b = deque.bottom.load(std::memory_order_relaxed) - 1;
+    deque.bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    long t = deque.top.load(std::memory_order_relaxed);
+    if (t > b)
+    {
+        deque.bottom.store(b + 1, std::memory_order_relaxed);
+        return false;
+    }
+    loadSlot<B>(deque.slots[b % WorkDeque<B>::CAPACITY], board);
+    if (t == b)
+    {
+        //Last board: race the thieves for it
+        bool won = deque.top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+        deque.bottom.store(b + 1, std::memory_order_relaxed);
+        return won;
+    }
+    return true;
+}
+
+// The board is copied out before the claim: once top has moved past the slot, the owner
+// may refill it. The owner only refills a slot top has already passed, so a copy that
+// overlaps a refill always loses the claim and is dropped; the atomic words of DequeSlot
+// keep the overlap itself well defined.
+template <int B>
+bool dequeSteal(WorkDeque<B> &deque, Board<B> &board)
+{
+    long t = deque.top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    long b = deque.bottom.load(std::memory_order_acquire);
+    if (t >= b)
+        return false;
+    loadSlot<B>(deque.slots[t % WorkDeque<B>::CAPACITY], board);
+    return deque.top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+}
+
+template <int B>
+bool dequeEmpty(const WorkDeque<B> &deque)
+{
+    return deque.bottom.load(std::memory_order_acquire) <= deque.top.load(std::memory_order_acquire);
+}
+
+// State shared by the solver threads of one rank. Grants from rank 0 land in the inbox,
+// which is only touched once per grant, everything else is lock-free. active counts the
+// threads that are looking for or working on a board, and events ticks whenever one starts
+// looking, so the main thread can tell a dry node from a momentarily quiet one. The deques
+// belong to solveOnThreads, which keeps them from one puzzle to the next. A solver thread
+// that stays out of work parks on wake, counted in sleepers, and the main thread waits on
+// mainWake between its MPI polls (see wakeSolvers and wakeMain).
+template <int B>
+struct ThreadedNode
+{
+    int threads;
+    WorkDeque<B> *deques;
+    std::mutex inboxLock;
+    std::vector<Board<B> > inbox;
+    std::atomic<int> inboxSize{0};
+    std::atomic<int> active{0};
+    std::atomic<long> events{0};
+    std::atomic<bool> cancelled{false};
+    std::atomic<bool> found{false};
+    std::atomic<bool> solutionReady{false};
+    std::atomic<long long> nodes{0};
+    std::mutex idleLock;
+    std::condition_variable wake;
+    std::condition_variable mainWake;
+    std::atomic<int> sleepers{0};
+    // The solver threads' counters, added up as they finish (see RankStats).
+    RankStats stats = {};
+    Board<B> solution;
+
+    ThreadedNode(int count, WorkDeque<B> *storage) : threads(count), deques(storage) {}
+};
+
+// Yields a thread out of work tries before it parks.
+const int IDLE_SPINS = 64;
+
+// Wakes the parked solver threads after work was published or the puzzle was cancelled.
+// The fence pairs with the one in runSolverThread: either the sleeper sees the work, or
+// this sees the sleeper.
+template <int B>
+void wakeSolvers(ThreadedNode<B> &node)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (node.sleepers.load(std::memory_order_relaxed) == 0)
+        return;
+    std::lock_guard<std::mutex> guard(node.idleLock);
+    node.wake.notify_all();
+}
+
+// Wakes the main thread early, for a solution it should send on at once.
+template <int B>
+void wakeMain(ThreadedNode<B> &node)
+{
+    std::lock_guard<std::mutex> guard(node.idleLock);
+    node.mainWake.notify_one();
+}
+
+template <int B>
+struct ThreadSlot
+{
+    ThreadedNode<B> *node;
+    int index;
+};
+
+// Backtrack hook of the solver threads: no MPI, just the shared cancel flag. While another
+// thread is out of work and this one has nothing queued, the untried values of the
+// shallowest open level are pushed for it to steal.
+template <int B>
+bool pollThreaded(PropagationBoard<B> &board, void *context)
+{
+    ThreadSlot<B> &slot = *(ThreadSlot<B> *)context;
+    ThreadedNode<B> &node = *slot.node;
+    if (node.cancelled.load(std::memory_order_relaxed))
+        return true;
+    WorkDeque<B> &own = node.deques[slot.index];
+    if (node.active.load(std::memory_order_relaxed) < node.threads && dequeEmpty<B>(own))
+    {
+        static thread_local std::vector<Board<B> > loot;
+        loot.clear();
+        splitSearch<B>(board, loot);
+        for (size_t i = 0; i < loot.size(); ++i)
+            dequePush<B>(own, loot[i]);
+        if (!loot.empty())
+            wakeSolvers<B>(node);
+    }
+    return false;
+}
+
+// Next board for thread index: its own deque, then the inbox, then the other deques.
+template <int B>
+bool takeBoard(ThreadedNode<B> &node, int index, std::mt19937 &rng, Board<B> &board)
+{
+    if (dequePop<B>(node.deques[index], board))
+        return true;
+    if (node.inboxSize.load() > 0)
+    {
+        std::lock_guard<std::mutex> guard(node.inboxLock);
+        if (!node.inbox.empty())
+        {
+            board = node.inbox.back();
+            node.inbox.pop_back();
+            node.inboxSize.store(node.inbox.size());
+            return true;
+        }
+    }
+    int start = rng() % node.threads;
+    for (int i = 0; i < node.threads; ++i)
+    {
+        int victim = (start + i) % node.threads;
+        if (victim != index && dequeSteal<B>(node.deques[victim], board))
+            return true;
+    }
+    return false;
+}
+
+template <int B>
+bool workVisible(ThreadedNode<B> &node)
+{
+    if (node.inboxSize.load() > 0)
+        return true;
+    for (int i = 0; i < node.threads; ++i)
+    {
+        if (!dequeEmpty<B>(node.deques[i]))
+            return true;
+    }
+    return false;
+}
+
+// True when no thread is working and no board is waiting anywhere on the node.
+template <int B>
+bool nodeIsDry(ThreadedNode<B> &node)
+{
+    long before = node.events.load();
+    if (node.active.load() != 0 || workVisible<B>(node))
+        return false;
+    return node.events.load() == before;
+}
+
+template <int B>
+void runSolverThread(ThreadedNode<B> &node, int index)
+{
+    constexpr int N = Geometry<B>::N;
+    ThreadSlot<B> slot = {&node, index};
+    std::mt19937 rng(index);
+#ifdef SUDOKU_STATS
+    traceThread = index + 1;
+    rankStats = RankStats();
+#endif
+    //One search board per thread, its trail and level stacks are reused from board to board
+    PropagationBoard<B> board;
+    board.poll = pollThreaded<B>;
+    board.pollContext = &slot;
+    Board<B> job;
+    while (!node.cancelled.load())
+    {
+        node.active.fetch_add(1);
+        node.events.fetch_add(1);
+        while (!node.cancelled.load() && takeBoard<B>(node, index, rng, job))
+        {
+            TRACE_SPAN(solveSpan, "solve");
+            bool solved = initPropagation<B>(board, job) && propagate<B>(board) && searchPropagation<B>(board);
+            if (solved && !node.found.exchange(true))
+            {
+                node.solution.assign(board.values, board.values + N * N);
+                node.solutionReady.store(true);
+                node.cancelled.store(true);
+                wakeSolvers<B>(node);
+                wakeMain<B>(node);
+            }
+        }
+        node.active.fetch_sub(1);
+        STAT_TIMER(idleTimer, idleMicros);
+        int spins = 0;
+        while (!node.cancelled.load() && !workVisible<B>(node))
+        {
+            if (++spins < IDLE_SPINS)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            //Park until a split, a grant or the end of the puzzle, leaving the core to the searchers
+            std::unique_lock<std::mutex> lock(node.idleLock);
+            node.sleepers.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            while (!node.cancelled.load() && !workVisible<B>(node))
+                node.wake.wait(lock);
+            node.sleepers.fetch_sub(1);
+        }
+    }
+    node.nodes.fetch_add(nodesVisited);
+#ifdef SUDOKU_STATS
+    std::lock_guard<std::mutex> guard(node.inboxLock);
+    node.stats.backtracks += rankStats.backtracks;
+    node.stats.placements += rankStats.placements;
+    node.stats.idleMicros += rankStats.idleMicros;
+#endif
+}
+
+// Worker side of --threads. The rank's main thread does all the MPI: it feeds grants to
+// the solver threads and asks rank 0 for more only once the whole node has run dry.
+// Speaks the same protocol as serveWorker. Returns true if this node sent the solution.
+template <int B>
+bool solveOnThreads(int threads, int workerQueueSize, std::vector<uint8_t> &grant)
+{
+    //Each deque is a fixed array of boards, too big to build for every puzzle
+    static std::unique_ptr<WorkDeque<B>[]> deques;
+    static int dequeCount = 0;
+    if (dequeCount < threads)
+    {
+        deques.reset(new WorkDeque<B>[threads]);
+        dequeCount = threads;
+    }
+    ThreadedNode<B> node(threads, deques.get());
+    int wanted = workerQueueSize * threads;
+    grant.resize(sizeof(int) + (size_t)wanted * Geometry<B>::MAX_GRANT_ENTRY_BYTES);
+    std::vector<std::thread> pool;
+    for (int i = 0; i < threads; ++i)
+        pool.emplace_back(runSolverThread<B>, std::ref(node), i);
+
+    //events[0] is the persistent grant receive, events[1] the stop broadcast
+    MPI_Request events[2];
+    int stopReason = 0;
+    MPI_Recv_init(grant.data(), grant.size(), MPI_BYTE, 0, TAG_GRANT, MCW, &events[0]);
+    MPI_Start(&events[0]);
+    bool grantArmed = true;
+    MPI_Ibcast(&stopReason, 1, MPI_INT, 0, MCW, &events[1]);
+    Outbox outbox;
+    bool exhausted = false;
+    bool reported = false;
+    //Sleep between probes, doubling while nothing happens up to the cancel latency
+    int backoff = 20;
+    while (events[1] != MPI_REQUEST_NULL)
+    {
+        int index = MPI_UNDEFINED, flag = 0;
+        bool progress = false;
+        MPI_Testany(2, events, &index, &flag, MPI_STATUS_IGNORE);
+        if (index == 0)
+        {
+            grantArmed = false;
+            progress = true;
+            std::vector<Board<B> > boards;
+            if (receiveGrant<B>(grant, boards) == 0)
+                exhausted = true;
+            TRACE_INSTANT("grant received", boards.size());
+            {
+                std::lock_guard<std::mutex> guard(node.inboxLock);
+                node.inbox.swap(boards);
+                node.inboxSize.store(node.inbox.size());
+            }
+            wakeSolvers<B>(node);
+        }
+        else if (index == 1)
+        {
+            break;
+        }
+
+        if (node.solutionReady.load() && !reported)
+        {
+            std::vector<uint8_t> packed(Geometry<B>::MAX_PACKED_BYTES);
+            int bytes = packBoard<B>(node.solution, packed.data());
+            postSend(outbox, packed.data(), bytes, 0, TAG_SOLVED);
+            reported = true;
+            progress = true;
+        }
+        else if (!grantArmed && !reported && nodeIsDry<B>(node))
+        {
+            //Ask for more, or once rank 0 has nothing left, report idle with a request for none
+            int request = exhausted ? 0 : wanted;
+            if (!exhausted)
+            {
+                MPI_Start(&events[0]);
+                grantArmed = true;
+            }
+            postSend(outbox, &request, sizeof(int), 0, TAG_MORE);
+            reported = exhausted;
+            progress = true;
+        }
+        reapSends(outbox);
+        if (progress)
+            backoff = 20;
+        else
+            backoff = (int)std::min<long long>(backoff * 2, std::max(20LL, cancelLatency));
+        //A solver that finds the solution cuts the sleep short
+        std::unique_lock<std::mutex> lock(node.idleLock);
+        if (!node.solutionReady.load())
+            node.mainWake.wait_for(lock, std::chrono::microseconds(backoff));
+    }
+
+    node.cancelled.store(true);
+    wakeSolvers<B>(node);
+    for (size_t i = 0; i < pool.size(); ++i)
+        pool[i].join();
+    //Leave the deques empty for the next puzzle
+    for (int i = 0; i < threads; ++i)
+    {
+        Board<B> left;
+        while (dequePop<B>(node.deques[i], left))
+            continue;
+    }
+    nodesVisited += node.nodes.load();
+#ifdef SUDOKU_STATS
+    //Idle time of a node is the average over its solver threads
+    rankStats.backtracks += node.stats.backtracks;
+    rankStats.placements += node.stats.placements;
+    rankStats.idleMicros += node.stats.idleMicros / threads;
+#endif
+    TRACE_INSTANT("stopped", -1);
+    retireWorker(outbox, events[0], grantArmed);
+    return node.solutionReady.load();
+}
+
+// Last step of a worker in the master schedule. Waits until rank 0 has received everything
+// this worker sent, joins the barrier that tells rank 0 all workers are idle, and only then
+// retires the grant receive, which stays armed until rank 0's last grant has landed.
+void retireWorker(Outbox &outbox, MPI_Request &grantRecv, bool grantArmed)
+{
+    MPI_Waitall(outbox.requests.size(), outbox.requests.data(), MPI_STATUSES_IGNORE);
+    for (size_t i = 0; i < outbox.buffers.size(); ++i)
+        outbox.spare.push_back(std::move(outbox.buffers[i]));
+    outbox.buffers.clear();
+    outbox.requests.clear();
+    MPI_Request barrier;
+    MPI_Ibarrier(MCW, &barrier);
+    MPI_Wait(&barrier, MPI_STATUS_IGNORE);
+    if (grantArmed)
+    {
+        MPI_Cancel(&grantRecv);
+        MPI_Wait(&grantRecv, MPI_STATUS_IGNORE);
+    }
+    MPI_Request_free(&grantRecv);
+}
+
+// What serveWorker keeps from puzzle to puzzle: the boards of the current grant, their
+// estimates, the sends in flight and the counting board. Once the first puzzles have
+// sized them, the work loop runs without heap allocations.
+template <int B>
+struct WorkerPool
+{
+    std::vector<Board<B> > queue;
+    std::vector<float> estimates;
+    Outbox outbox;
+    PropagationBoard<B> counter;
+};
+
+// Worker side of the master schedule. Blocks in MPI_Waitany on the next grant or the stop
+// broadcast whenever it has nothing to solve, and asks for the next grant as it starts on
+// the last board of the current one. While solving, pollCancel tests the stop broadcast.
+// With a costLog, every board's estimated and actual search nodes are written to it.
+// With a strategy every board is searched with it instead of the solver (portfolio schedule).
+// With a countLimit the worker counts the solutions of every board instead, reports each
+// board's count to rank 0 and writes the solutions to solutionsOut when given. Returns the
+// number of solutions this worker counted.
+template <int B>
+long long serveWorker(SolverType solver, int workerQueueSize, std::vector<uint8_t> &grant, std::ostream *costLog, int puzzleNumber, SearchStrategy *strategy, std::ostream *solutionsOut)
+{
+    static WorkerPool<B> pool;
+    std::vector<Board<B> > &queue = pool.queue;
+    std::vector<float> &estimates = pool.estimates;
+    Outbox &outbox = pool.outbox;
+    queue.clear();
+    int workingIndex = 0;
+    grant.resize(sizeof(int) + (size_t)workerQueueSize * Geometry<B>::MAX_GRANT_ENTRY_BYTES);
+
+    //events[0] is the persistent grant receive, events[1] the stop broadcast
+    MPI_Request events[2];
+    int stopReason = 0;
+    MPI_Recv_init(grant.data(), grant.size(), MPI_BYTE, 0, TAG_GRANT, MCW, &events[0]);
+    MPI_Start(&events[0]);
+    bool grantArmed = true;
+    MPI_Ibcast(&stopReason, 1, MPI_INT, 0, MCW, &events[1]);
+    stopSignal = &events[1];
+    bool exhausted = false;
+    long long counted = 0;
+    PropagationBoard<B> *counter = countLimit >= 0 ? &pool.counter : nullptr;
+
+    while (events[1] != MPI_REQUEST_NULL)
+    {
+        //Out of boards: sleep until a grant or the stop arrives
+        if (workingIndex == (int)queue.size())
+        {
+            int index;
+            {
+                STAT_TIMER(idleTimer, idleMicros);
+                TRACE_SPAN(idleSpan, "idle");
+                MPI_Waitany(2, events, &index, MPI_STATUS_IGNORE);
+            }
+            if (index != 0)
+                continue;
+            grantArmed = false;
+            queue.clear();
+            workingIndex = 0;
+            int received = receiveGrant<B>(grant, queue, &estimates);
+            TRACE_INSTANT("grant received", received);
+            if (received == 0)
+            {
+                //Rank 0 has nothing left, tell it this worker is idle
+                int none = 0;
+                exhausted = true;
+                postSend(outbox, &none, sizeof(int), 0, TAG_MORE);
+            }
+            continue;
+        }
+
+        //Prefetch the next grant while solving the last board of this one
+        if (workingIndex + 1 == (int)queue.size() && !exhausted)
+        {
+            MPI_Start(&events[0]);
+            grantArmed = true;
+            postSend(outbox, &workerQueueSize, sizeof(int), 0, TAG_MORE);
+        }
+        long long nodesBefore = nodesVisited;
+        if (counter)
+        {
+            TRACE_SPAN(countSpan, "count");
+            long long budget = LLONG_MAX;
+            long long found = 0;
+            if (initPropagation<B>(*counter, queue[workingIndex]) && propagate<B>(*counter))
+                found = countSolutions<B>(*counter, countLimit > 0 ? countLimit : LLONG_MAX, budget, solutionsOut);
+            nodesVisited += LLONG_MAX - budget;
+            counted += found;
+            if (found > 0)
+                postSend(outbox, &found, sizeof(long long), 0, TAG_COUNT);
+            ++workingIndex;
+            reapSends(outbox);
+            continue;
+        }
+        TRACE_SPAN(solveSpan, "solve");
+        bool solved = strategy ? solvePuzzlePortfolio<B>(queue[workingIndex], *strategy) : solveWith<B>(solver, queue[workingIndex]);
+        if (costLog)
+        {
+            int stopped = false;
+            MPI_Test(&events[1], &stopped, MPI_STATUS_IGNORE);
+            const char *outcome = solved ? "solved" : (stopped ? "cancelled" : "exhausted");
+            *costLog << puzzleNumber << "," << estimates[workingIndex] << "," << nodesVisited - nodesBefore << "," << outcome << "\n";
+        }
+        if (solved)
+        {
+            uint8_t packed[Geometry<B>::MAX_PACKED_BYTES];
+            int bytes = packBoard<B>(queue[workingIndex], packed);
+            postSend(outbox, packed, bytes, 0, TAG_SOLVED);
+            MPI_Wait(&events[1], MPI_STATUS_IGNORE);
+        }
+        ++workingIndex;
+        reapSends(outbox);
+    }
+    stopSignal = nullptr;
+    TRACE_INSTANT("stopped", -1);
+    retireWorker(outbox, events[0], grantArmed);
+    return counted;
+}
+
+// Rank 0's own search with --master-solves. A thread of its own takes single boards off
+// the cheap end of the frontier, so end is the first board it has taken and next the first
+// one the grants from the front have not. Only the supervisor's main thread talks MPI: the
+// solver thread just sets found or done, and it is stopped through cancelled.
+template <int B>
+struct LocalSolver
+{
+    const Frontier<B> *queue;
+    std::mutex lock;
+    int next;
+    int end;
+    std::atomic<bool> cancelled{false};
+    std::atomic<bool> found{false};
+    std::atomic<bool> done{false};
+    Board<B> solution;
+    long long nodes = 0;
+    // The thread's counters, added to rank 0's when it is joined (see RankStats).
+    RankStats stats = {};
+};
+
+// Backtrack hook of rank 0's solver thread: no MPI, just the cancel flag.
+template <int B>
+bool pollLocal(PropagationBoard<B> &board, void *context)
+{
+    return ((LocalSolver<B> *)context)->cancelled.load(std::memory_order_relaxed);
+}
+
+template <int B>
+void runLocalSolver(LocalSolver<B> &local)
+{
+    constexpr int CELLS = Geometry<B>::CELLS;
+#ifdef SUDOKU_STATS
+    traceThread = 1;
+    rankStats = RankStats();
+#endif
+    PropagationBoard<B> board;
+    board.poll = pollLocal<B>;
+    board.pollContext = &local;
+    Board<B> job;
+    while (!local.cancelled.load())
+    {
+        {
+            std::lock_guard<std::mutex> guard(local.lock);
+            if (local.end <= local.next)
+                break;
+            --local.end;
+            job.assign((*local.queue)[local.end], (*local.queue)[local.end] + CELLS);
+        }
+        TRACE_SPAN(solveSpan, "solve");
+        if (initPropagation<B>(board, job) && propagate<B>(board) && searchPropagation<B>(board))
+        {
+            local.solution.assign(board.values, board.values + CELLS);
+            local.found.store(true);
+            break;
+        }
+    }
+    local.nodes = nodesVisited;
+#ifdef SUDOKU_STATS
+    local.stats = rankStats;
+#endif
+    local.done.store(true);
+}
+
+// Packs the next boards of the frontier before limit for dest and starts a synchronous send
+// of them. A grant takes boards until their summed weight would pass budget or it holds wanted
+// of them, but always at least one, so an expensive board goes out alone and cheap ones
+// go out together. An empty grant tells the worker the frontier is used up.
+template <int B>
+void postGrant(const Frontier<B> &queue, const std::vector<double> &weight, int &next, int limit, int wanted, double budget, int dest, std::vector<uint8_t> &buffer, MPI_Request &request)
+{
+    if (request != MPI_REQUEST_NULL)
+        MPI_Wait(&request, MPI_STATUS_IGNORE);
+    int quantity = 0;
+    double spent = 0;
+    while (next + quantity < limit && quantity < wanted && (quantity == 0 || spent + weight[next + quantity] <= budget))
+        spent += weight[next + quantity++];
+    int bytes = packGrant<B>(queue, next, quantity, buffer);
+    next += quantity;
+    TRACE_INSTANT("grant", quantity);
+    MPI_Issend(buffer.data(), bytes, MPI_BYTE, dest, TAG_GRANT, MCW, &request);
+}
+
+// Rank 0 side of the master schedule, an event loop over persistent receives (one per
+// worker) and the outstanding grants. It ends the puzzle once a worker reports a solution
+// or every worker reports idle, by starting the stop broadcast and then a nonblocking
+// barrier that completes when all workers have gone idle. Grants are synchronous sends,
+// so none can still be in flight by then. Returns the rank that solved the puzzle, or -1
+// if it has no solution; foundTime is when the outcome became known.
+// With solveHere rank 0 searches too (see LocalSolver), and the loop polls instead of
+// blocking so that it notices what its own solver finds.
+// With groupStart the workers race instead of sharing: worker w belongs to group
+// w % groups, owns boards [groupStart[g], groupStart[g + 1]) and walks all of them on its
+// own. One worker running through its group's boards proves they have no solution.
+// When counting (countLimit > 0) the puzzle also ends once the reported counts reach it.
+template <int B>
+int superviseWorkers(int size, const Frontier<B> &queue, int workerQueueSize, Board<B> &solution, std::chrono::steady_clock::time_point &foundTime, const std::vector<int> *groupStart, bool solveHere)
+{
+    const int workers = size - 1;
+    const int messageBytes = std::max((int)sizeof(int), Geometry<B>::MAX_PACKED_BYTES);
+    const int STOP = 2 * workers;
+    const int BARRIER = 2 * workers + 1;
+    //The receives from each worker, then the grants to each worker, then STOP and BARRIER
+    std::vector<MPI_Request> requests(2 * workers + 2, MPI_REQUEST_NULL);
+    std::vector<std::vector<uint8_t> > inbox(workers, std::vector<uint8_t>(messageBytes));
+    std::vector<std::vector<uint8_t> > grants(workers);
+    const int groups = groupStart ? (int)groupStart->size() - 1 : 0;
+    //Shared: one cursor for everybody. Racing: a cursor per worker over its group's boards
+    std::vector<int> next(groups ? workers : 1, 0);
+    std::vector<int> limit(next.size(), queue.size());
+    //Weigh the boards linearly relative to the most expensive one, and aim for about two
+    //grants per worker, as generateQueue does. A racer has its whole group to itself.
+    std::vector<double> weight(queue.size());
+    std::vector<double> budget(next.size(), 0);
+    for (int i = 0; i < queue.size(); ++i)
+        weight[i] = exp2(queue.cost[i] - queue.cost[0]);
+    for (int c = 0; c < (int)next.size(); ++c)
+    {
+        if (groups)
+        {
+            next[c] = (*groupStart)[c % groups];
+            limit[c] = (*groupStart)[c % groups + 1];
+        }
+        for (int i = next[c]; i < limit[c]; ++i)
+            budget[c] += weight[i];
+        budget[c] /= groups ? 2.0 : 2.0 * (workers + solveHere);
+    }
+    //Rank 0's own solver takes boards off the back under local.lock, see LocalSolver
+    LocalSolver<B> local;
+    local.queue = &queue;
+    local.next = 0;
+    local.end = queue.size();
+    for (int w = 0; w < workers; ++w)
+    {
+        int c = groups ? w : 0;
+        MPI_Recv_init(inbox[w].data(), messageBytes, MPI_BYTE, w + 1, MPI_ANY_TAG, MCW, &requests[w]);
+        MPI_Start(&requests[w]);
+        postGrant<B>(queue, weight, next[c], limit[c], workerQueueSize, budget[c], w + 1, grants[w], requests[workers + w]);
+    }
+    local.next = next[0];
+    //Nothing left after the first grants, so rank 0 just supervises
+    solveHere = solveHere && local.next < local.end;
+    std::thread localThread;
+    if (solveHere)
+        localThread = std::thread(runLocalSolver<B>, std::ref(local));
+    bool localDone = false;
+
+    int winner = -1;
+    int idle = 0;
+    std::vector<bool> groupDone(groups, false);
+    long long counted = 0;
+    bool stopping = false;
+    bool stopPosted = false;
+    bool barrierPosted = false;
+    while (true)
+    {
+        int index = MPI_UNDEFINED;
+        MPI_Status status;
+        if (solveHere)
+        {
+            int flag = 0;
+            MPI_Testany(requests.size(), requests.data(), &index, &flag, &status);
+            if (!flag)
+                index = MPI_UNDEFINED;
+            if (!stopping && local.found.load())
+            {
+                solution = local.solution;
+                winner = 0;
+                stopping = true;
+            }
+            else if (!localDone && local.done.load())
+            {
+                //Rank 0 is out of boards too, which only ends the puzzle once the workers are
+                localDone = true;
+                stopping = stopping || idle == workers;
+            }
+            if (index == MPI_UNDEFINED)
+                usleep(20);
+        }
+        else
+        {
+            MPI_Waitany(requests.size(), requests.data(), &index, &status);
+        }
+        if (index == BARRIER)
+        {
+            TRACE_INSTANT("all idle", -1);
+            break;
+        }
+        if (index >= 0 && index < workers)
+        {
+            if (!stopping && status.MPI_TAG == TAG_SOLVED)
+            {
+                unpackBoard<B>(inbox[index].data(), solution);
+                winner = index + 1;
+                stopping = true;
+            }
+            else if (!stopping && status.MPI_TAG == TAG_COUNT)
+            {
+                long long found;
+                memcpy(&found, inbox[index].data(), sizeof(long long));
+                counted += found;
+                stopping = countLimit > 0 && counted >= countLimit;
+            }
+            else if (!stopping && status.MPI_TAG == TAG_MORE)
+            {
+                int wanted;
+                memcpy(&wanted, inbox[index].data(), sizeof(int));
+                int c = groups ? index : 0;
+                if (wanted > 0)
+                {
+                    std::unique_lock<std::mutex> guard(local.lock);
+                    if (solveHere)
+                        limit[c] = local.end;
+                    postGrant<B>(queue, weight, next[c], limit[c], wanted, budget[c] * wanted / workerQueueSize, index + 1, grants[index], requests[workers + index]);
+                    local.next = next[c];
+                }
+                else if (!groups && ++idle == workers)
+                    stopping = !solveHere || localDone;
+                else if (groups && !groupDone[index % groups])
+                {
+                    groupDone[index % groups] = true;
+                    stopping = ++idle == groups;
+                }
+            }
+            MPI_Start(&requests[index]);
+        }
+        if (stopping && !stopPosted)
+        {
+            foundTime = std::chrono::steady_clock::now();
+            local.cancelled.store(true);
+            MPI_Ibcast(&winner, 1, MPI_INT, 0, MCW, &requests[STOP]);
+            stopPosted = true;
+            TRACE_INSTANT("stop", winner);
+        }
+
+        //Once every grant has landed, wait for the workers to go idle
+        bool grantsDone = true;
+        for (int w = 0; w < workers; ++w)
+            grantsDone = grantsDone && requests[workers + w] == MPI_REQUEST_NULL;
+        if (stopping && grantsDone && !barrierPosted)
+        {
+            MPI_Ibarrier(MCW, &requests[BARRIER]);
+            barrierPosted = true;
+        }
+    }
+
+    if (requests[STOP] != MPI_REQUEST_NULL)
+        MPI_Wait(&requests[STOP], MPI_STATUS_IGNORE);
+    for (int w = 0; w < workers; ++w)
+    {
+        MPI_Cancel(&requests[w]);
+        MPI_Wait(&requests[w], MPI_STATUS_IGNORE);
+        MPI_Request_free(&requests[w]);
+    }
+    if (localThread.joinable())
+        localThread.join();
+    nodesVisited += local.nodes;
+#ifdef SUDOKU_STATS
+    rankStats.backtracks += local.stats.backtracks;
+    rankStats.placements += local.stats.placements;
+#endif
+    return winner;
+}
+
+// Reorders a cost sorted frontier so that dealing its boards round robin to groups puts
+// each group's boards next to each other. Group g gets [groupStart[g], groupStart[g + 1]),
+// still most expensive first, and every group about the same share of the work.
+template <int B>
+void dealFrontier(Frontier<B> &frontier, int groups, std::vector<int> &groupStart)
+{
+    constexpr int CELLS = Geometry<B>::CELLS;
+    int count = frontier.size();
+    std::vector<typename Geometry<B>::Cell> cells(frontier.cells.size());
+    std::vector<float> cost(count);
+    groupStart.assign(groups + 1, 0);
+    int to = 0;
+    for (int g = 0; g < groups; ++g)
+    {
+        groupStart[g] = to;
+        for (int from = g; from < count; from += groups)
+        {
+            std::copy(frontier[from], frontier[from] + CELLS, cells.begin() + (size_t)to * CELLS);
+            cost[to++] = frontier.cost[from];
+        }
+    }
+    groupStart[groups] = to;
+    frontier.cells.swap(cells);
+    frontier.cost.swap(cost);
+}
+
+// Groups the portfolio schedule actually uses: every group needs at least one worker.
+int portfolioGroupCount(int workers)
+{
+    return std::max(1, std::min(portfolioGroups, workers));
+}
+
+// Collective over MCW: splits it into nodes and node leaders for the shared schedule.
+// Rank 0 comes out as the leader of its node and as leader 0.
+void openSharedFrontier()
+{
+    int rank;
     MPI_Comm_rank(MCW, &rank);
-    MPI_Comm_size(MCW, &size);
-    srand(rank + time(0));
+    MPI_Comm_split_type(MCW, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &sharedFrontier.node);
+    MPI_Comm_rank(sharedFrontier.node, &sharedFrontier.nodeRank);
+    MPI_Comm_size(sharedFrontier.node, &sharedFrontier.nodeSize);
+    MPI_Comm_split(MCW, sharedFrontier.nodeRank == 0 ? 0 : MPI_UNDEFINED, rank, &sharedFrontier.leaders);
+    if (sharedFrontier.leaders != MPI_COMM_NULL)
+    {
+        int nodes;
+        MPI_Comm_size(sharedFrontier.leaders, &nodes);
+        sharedFrontier.nodeSizes.resize(rank == 0 ? nodes : 0);
+        MPI_Gather(&sharedFrontier.nodeSize, 1, MPI_INT, sharedFrontier.nodeSizes.data(), 1, MPI_INT, 0, sharedFrontier.leaders);
+    }
+}
+
+// Collective over the node: makes the window hold at least bytes after the header. It
+// grows by doubling, so a run soon settles on one window.
+void reserveSharedFrontier(size_t bytes)
+{
+    if (bytes <= sharedFrontier.capacity)
+        return;
+    if (sharedFrontier.window != MPI_WIN_NULL)
+    {
+        MPI_Win_unlock_all(sharedFrontier.window);
+        MPI_Win_free(&sharedFrontier.window);
+    }
+    const size_t headerBytes = (sizeof(SharedHeader) + 63) / 64 * 64;
+    sharedFrontier.capacity = std::max(bytes, 2 * sharedFrontier.capacity);
+    void *base;
+    MPI_Win_allocate_shared(sharedFrontier.nodeRank == 0 ? headerBytes + sharedFrontier.capacity : 0, 1, MPI_INFO_NULL, sharedFrontier.node, &base, &sharedFrontier.window);
+    MPI_Aint windowBytes;
+    int unit;
+    void *owned;
+    MPI_Win_shared_query(sharedFrontier.window, 0, &windowBytes, &unit, &owned);
+    sharedFrontier.header = (SharedHeader *)owned;
+    sharedFrontier.data = (uint8_t *)owned + headerBytes;
+    if (sharedFrontier.nodeRank == 0)
+        new (sharedFrontier.header) SharedHeader();
+    //One passive epoch for the window's lifetime, MPI_Win_sync orders the plain loads and stores
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, sharedFrontier.window);
+}
+
+// Collective over the communicator the shared frontier was opened on, so it runs before
+// that communicator changes or goes away.
+void releaseSharedFrontier()
+{
+    if (sharedFrontier.node == MPI_COMM_NULL)
+        return;
+    if (sharedFrontier.window != MPI_WIN_NULL)
+    {
+        MPI_Win_unlock_all(sharedFrontier.window);
+        MPI_Win_free(&sharedFrontier.window);
+    }
+    if (sharedFrontier.leaders != MPI_COMM_NULL)
+        MPI_Comm_free(&sharedFrontier.leaders);
+    MPI_Comm_free(&sharedFrontier.node);
+    sharedFrontier.capacity = 0;
+    sharedFrontier.nodeSizes.clear();
+}
+
+// Collective over the node: the leader passes in the node's share of the frontier, and
+// every rank of the node returns once the window holds it with the claim counter reset.
+template <int B>
+void fillSharedFrontier(const typename Geometry<B>::Cell *boards, int count)
+{
+    constexpr int CELLS = Geometry<B>::CELLS;
+    typedef typename Geometry<B>::Cell Cell;
+    MPI_Bcast(&count, 1, MPI_INT, 0, sharedFrontier.node);
+    //The boards, then room for the solution
+    reserveSharedFrontier((size_t)(count + 1) * CELLS * sizeof(Cell));
+    if (sharedFrontier.nodeRank == 0)
+    {
+        SharedHeader &header = *sharedFrontier.header;
+        std::copy(boards, boards + (size_t)count * CELLS, (Cell *)sharedFrontier.data);
+        header.next.store(0);
+        header.finished.store(0);
+        header.winner.store(-1);
+        header.ready.store(false);
+        header.count = count;
+    }
+    MPI_Win_sync(sharedFrontier.window);
+    MPI_Barrier(sharedFrontier.node);
+    MPI_Win_sync(sharedFrontier.window);
+}
+
+// Backtrack hook of the shared schedule: stops once anyone on the node has solved the
+// puzzle, which costs one load of a cache line that is only written once, or once the
+// stop broadcast from rank 0 has arrived.
+template <int B>
+bool pollSharedFrontier(PropagationBoard<B> &board, void *context)
+{
+    return sharedFrontier.header->winner.load(std::memory_order_relaxed) >= 0 || pollCancel();
+}
+
+// Solver side of the shared schedule, on every rank but rank 0 once fillSharedFrontier
+// has returned. Claims boards until they run out or the puzzle is stopped, then waits for
+// the stop broadcast. Meanwhile a leader reports for its node: the winning rank and its
+// solution as soon as there is one, or else that every solver of the node is done.
+template <int B>
+void solveSharedFrontier(int rank, Outbox &outbox)
+{
+    constexpr int CELLS = Geometry<B>::CELLS;
+    typedef typename Geometry<B>::Cell Cell;
+    SharedHeader &header = *sharedFrontier.header;
+    const Cell *boards = (const Cell *)sharedFrontier.data;
+    int stopReason = 0;
+    MPI_Request stop;
+    MPI_Ibcast(&stopReason, 1, MPI_INT, 0, MCW, &stop);
+    stopSignal = &stop;
+    static PropagationBoard<B> board;
+    board.poll = pollSharedFrontier<B>;
+    Board<B> job;
+    while (header.winner.load(std::memory_order_relaxed) < 0)
+    {
+        int i = header.next.fetch_add(1);
+        if (i >= header.count)
+            break;
+        STAT_ADD(boards, 1);
+        job.assign(boards + (size_t)i * CELLS, boards + (size_t)(i + 1) * CELLS);
+        TRACE_SPAN(solveSpan, "solve");
+        if (initPropagation<B>(board, job) && propagate<B>(board) && searchPropagation<B>(board))
+        {
+            int nobody = -1;
+            if (header.winner.compare_exchange_strong(nobody, rank))
+            {
+                std::copy(board.values, board.values + CELLS, (Cell *)sharedFrontier.data + (size_t)header.count * CELLS);
+                header.ready.store(true);
+            }
+            break;
+        }
+        if (board.cancelled)
+            break;
+    }
+    header.finished.fetch_add(1);
+    stopSignal = nullptr;
+
+    bool reported = sharedFrontier.nodeRank != 0;
+    int stopped = 0;
+    STAT_TIMER(idleTimer, idleMicros);
+    TRACE_SPAN(idleSpan, "idle");
+    MPI_Test(&stop, &stopped, MPI_STATUS_IGNORE);
+    while (!stopped && !reported)
+    {
+        //Read finished before ready: once all are finished, a solution is already in
+        int finished = header.finished.load();
+        if (header.ready.load() || finished == sharedFrontier.nodeSize)
+        {
+            uint8_t packed[sizeof(int) + Geometry<B>::MAX_PACKED_BYTES];
+            int winner = header.ready.load() ? header.winner.load() : -1;
+            int bytes = sizeof(int);
+            memcpy(packed, &winner, sizeof(int));
+            if (winner >= 0)
+            {
+                const Cell *solved = (const Cell *)sharedFrontier.data + (size_t)header.count * CELLS;
+                bytes += packBoard<B>(Board<B>(solved, solved + CELLS), packed + sizeof(int));
+            }
+            postSend(outbox, packed, bytes, 0, winner >= 0 ? TAG_SOLVED : TAG_MORE);
+            reported = true;
+        }
+        else
+        {
+            usleep(20);
+        }
+        MPI_Test(&stop, &stopped, MPI_STATUS_IGNORE);
+    }
+    //Nothing left to report, so block on the stop broadcast instead of polling it
+    if (!stopped)
+        MPI_Wait(&stop, MPI_STATUS_IGNORE);
+}
+
+// Rank 0 side of the shared schedule. Deals the frontier to the nodes, most expensive
+// boards first, each to the node with the least estimated work per solver so far, and
+// scatters the shares to the leaders. Then watches its own node's window directly and the
+// other leaders' reports until a solution turns up or every node has run out of boards,
+// and stops the puzzle. Returns the rank that solved it or -1, like superviseWorkers.
+template <int B>
+int superviseSharedFrontier(const Frontier<B> &queue, Board<B> &solution, std::chrono::steady_clock::time_point &foundTime)
+{
+    constexpr int CELLS = Geometry<B>::CELLS;
+    typedef typename Geometry<B>::Cell Cell;
+    const std::vector<int> &nodeSizes = sharedFrontier.nodeSizes;
+    const int nodes = nodeSizes.size();
+    //Rank 0 supervises, so its node has one solver less
+    std::vector<int> solvers(nodeSizes);
+    solvers[0] -= 1;
+    std::vector<int> owner(queue.size());
+    std::vector<int> counts(nodes, 0);
+    std::vector<double> load(nodes, 0);
+    for (int i = 0; i < queue.size(); ++i)
+    {
+        int best = 0;
+        for (int k = 1; k < nodes; ++k)
+        {
+            if (solvers[k] > 0 && (solvers[best] == 0 || load[k] * solvers[best] < load[best] * solvers[k]))
+                best = k;
+        }
+        owner[i] = best;
+        load[best] += exp2(queue.cost[i] - queue.cost[0]);
+        ++counts[best];
+    }
+    std::vector<int> bytes(nodes);
+    std::vector<int> offsets(nodes);
+    std::vector<int> place(nodes);
+    for (int k = 0, first = 0; k < nodes; first += counts[k++])
+    {
+        place[k] = first;
+        offsets[k] = first * CELLS * sizeof(Cell);
+        bytes[k] = counts[k] * CELLS * sizeof(Cell);
+    }
+    std::vector<Cell> dealt(queue.cells.size());
+    for (int i = 0; i < queue.size(); ++i)
+        std::copy(queue[i], queue[i] + CELLS, dealt.begin() + (size_t)place[owner[i]]++ * CELLS);
+    int mine;
+    MPI_Scatter(counts.data(), 1, MPI_INT, &mine, 1, MPI_INT, 0, sharedFrontier.leaders);
+    MPI_Scatterv(dealt.data(), bytes.data(), offsets.data(), MPI_BYTE, MPI_IN_PLACE, 0, MPI_BYTE, 0, sharedFrontier.leaders);
+    fillSharedFrontier<B>(dealt.data(), mine);
+
+    SharedHeader &header = *sharedFrontier.header;
+    std::vector<uint8_t> message(sizeof(int) + Geometry<B>::MAX_PACKED_BYTES);
+    int winner = -1;
+    int nodesDone = 0;
+    bool ownDone = false;
+    while (winner < 0 && nodesDone < nodes)
+    {
+        //Read finished before ready, as the leaders do
+        int finished = header.finished.load();
+        if (!ownDone && header.ready.load())
+        {
+            const Cell *solved = (const Cell *)sharedFrontier.data + (size_t)mine * CELLS;
+            solution.assign(solved, solved + CELLS);
+            winner = header.winner.load();
+            continue;
+        }
+        if (!ownDone && finished == solvers[0])
+        {
+            ownDone = true;
+            ++nodesDone;
+            continue;
+        }
+        int flag = 0;
+        MPI_Status status;
+        MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MCW, &flag, &status);
+        if (!flag)
+        {
+            usleep(20);
+            continue;
+        }
+        //Leaders only ever send their one report, anything else would end the puzzle wrongly
+        if (status.MPI_TAG != TAG_SOLVED && status.MPI_TAG != TAG_MORE)
+        {
+            std::cerr << "Rank 0 got a message with tag " << status.MPI_TAG << " from rank " << status.MPI_SOURCE << " in the shared schedule.\n";
+            MPI_Abort(MCW, 1);
+        }
+        int received;
+        MPI_Get_count(&status, MPI_BYTE, &received);
+        MPI_Recv(message.data(), received, MPI_BYTE, status.MPI_SOURCE, status.MPI_TAG, MCW, MPI_STATUS_IGNORE);
+        if (status.MPI_TAG == TAG_SOLVED)
+        {
+            unpackBoard<B>(message.data() + sizeof(int), solution);
+            memcpy(&winner, message.data(), sizeof(int));
+        }
+        else
+            ++nodesDone;
+    }
+    foundTime = std::chrono::steady_clock::now();
+    TRACE_INSTANT("stop", winner);
+    MPI_Request stop;
+    MPI_Ibcast(&winner, 1, MPI_INT, 0, MCW, &stop);
+    MPI_Wait(&stop, MPI_STATUS_IGNORE);
+    return winner;
+}
+
+// Cells canonicalize may compare before it settles for the first of several tied
+// orders. An exact 9x9 search needs about a quarter of it.
+const long long CANONICAL_CELLS = 1 << 18;
+
+// State of one canonicalize search. A canonical cell holds its relabelled digit, or N + 1
+// for an empty cell so that givens sort first. best holds the least board found so far,
+// of which only the first bestRows rows are known yet.
+template <int B>
+struct CanonicalSearch
+{
+    const Board<B> *puzzle;
+    bool transpose;
+    const short *columns;
+    short rows[B * B];
+    bool used[B * B];
+    short best[B * B * B * B];
+    int bestRows;
+    long long budget;
+    Transform<B> transform;
+};
+
+// Picks the original row for canonical row row and recurses. Rows stay in their band
+// and bands stay whole. digits[0] holds the next unused label, digits are labelled in
+// the order they first appear. Gives up on ties once the budget is spent and some
+// complete order is known.
+template <int B>
+void canonicalRows(CanonicalSearch<B> &search, int row, const short *digits)
+{
+    constexpr int N = Geometry<B>::N;
+    const Board<B> &puzzle = *search.puzzle;
+    if (row == N)
+    {
+        search.transform.transpose = search.transpose;
+        std::copy(search.rows, search.rows + N, search.transform.rows);
+        std::copy(search.columns, search.columns + N, search.transform.columns);
+        std::copy(digits, digits + N + 1, search.transform.digits);
+        return;
+    }
+    for (int original = 0; original < N; ++original)
+    {
+        if (search.used[original] || (row % B != 0 && original / B != search.rows[row - 1] / B))
+            continue;
+        short next[N + 1];
+        short line[N];
+        std::copy(digits, digits + N + 1, next);
+        int order = row < search.bestRows ? 0 : -1;
+        for (int c = 0; c < N; ++c)
+        {
+            int from = search.columns[c];
+            int v = search.transpose ? puzzle[from * N + original] : puzzle[original * N + from];
+            if (v == -1)
+                line[c] = N + 1;
+            else
+                line[c] = next[v] ? next[v] : (next[v] = ++next[0]);
+            --search.budget;
+            if (order == 0 && line[c] != search.best[row * N + c])
+                order = line[c] < search.best[row * N + c] ? -1 : 1;
+            if (order > 0)
+                break;
+        }
+        if (order > 0)
+            continue;
+        if (order < 0)
+        {
+            std::copy(line, line + N, search.best + row * N);
+            search.bestRows = row + 1;
+        }
+        search.rows[row] = original;
+        search.used[original] = true;
+        canonicalRows<B>(search, row + 1, next);
+        search.used[original] = false;
+        if (search.budget <= 0 && search.bestRows == N)
+            return;
+    }
+}
+
+// Maps puzzle onto the least board, row by row, reachable by relabelling digits,
+// reordering the rows of a band, reordering bands and transposing, with empty cells
+// sorting after every digit. On 9x9 the columns and stacks are reordered as well, over
+// all 1296 orders. Larger grids keep their columns, which still catches duplicates,
+// relabellings, transposes and row swaps. Equal puzzles always get the same result,
+// and transform records how to get from puzzle to canonical.
+template <int B>
+void canonicalize(const Board<B> &puzzle, Board<B> &canonical, Transform<B> &transform)
+{
+    constexpr int N = Geometry<B>::N;
+    static std::vector<short> columnOrders;
+    if (columnOrders.empty())
+    {
+        //Every order of the stacks times every order within each stack
+        std::vector<std::vector<short> > perms;
+        std::vector<short> perm(B);
+        for (int i = 0; i < B; ++i)
+            perm[i] = i;
+        do
+            perms.push_back(perm);
+        while (B == 3 && std::next_permutation(perm.begin(), perm.end()));
+        std::vector<int> pick(B + 1, 0);
+        while (true)
+        {
+            for (int c = 0; c < N; ++c)
+                columnOrders.push_back(perms[pick[0]][c / B] * B + perms[pick[1 + c / B]][c % B]);
+            int d = 0;
+            while (d <= B && ++pick[d] == (int)perms.size())
+                pick[d++] = 0;
+            if (d > B)
+                break;
+        }
+    }
+
+    CanonicalSearch<B> search;
+    search.puzzle = &puzzle;
+    search.bestRows = 0;
+    search.budget = CANONICAL_CELLS;
+    std::fill(search.used, search.used + N, false);
+    short digits[N + 1] = {0};
+    for (int t = 0; t < 2 && search.budget > 0; ++t)
+    {
+        search.transpose = t;
+        for (size_t first = 0; first < columnOrders.size() && search.budget > 0; first += N)
+        {
+            search.columns = columnOrders.data() + first;
+            canonicalRows<B>(search, 0, digits);
+        }
+    }
+
+    //Digits the puzzle never gives take the labels left over, in order
+    transform = search.transform;
+    for (int d = 1; d <= N; ++d)
+        if (!transform.digits[d])
+            transform.digits[d] = ++transform.digits[0];
+    canonical.resize(N * N);
+    for (int i = 0; i < N * N; ++i)
+        canonical[i] = search.best[i] == N + 1 ? -1 : search.best[i];
+}
+
+// Applies transform to a board of the original puzzle, such as its solution.
+template <int B>
+void applyTransform(const Board<B> &board, const Transform<B> &transform, Board<B> &out)
+{
+    constexpr int N = Geometry<B>::N;
+    out.resize(N * N);
+    for (int r = 0; r < N; ++r)
+        for (int c = 0; c < N; ++c)
+        {
+            int from = transform.transpose ? transform.columns[c] * N + transform.rows[r] : transform.rows[r] * N + transform.columns[c];
+            out[r * N + c] = board[from] == -1 ? -1 : transform.digits[board[from]];
+        }
+}
+
+// Undoes applyTransform, mapping a canonical board back onto the original puzzle.
+template <int B>
+void revertTransform(const Board<B> &board, const Transform<B> &transform, Board<B> &out)
+{
+    constexpr int N = Geometry<B>::N;
+    short original[N + 1];
+    for (int d = 1; d <= N; ++d)
+        original[transform.digits[d]] = d;
+    out.resize(N * N);
+    for (int r = 0; r < N; ++r)
+        for (int c = 0; c < N; ++c)
+        {
+            int to = transform.transpose ? transform.columns[c] * N + transform.rows[r] : transform.rows[r] * N + transform.columns[c];
+            out[to] = board[r * N + c] == -1 ? -1 : original[board[r * N + c]];
+        }
+}
+
+// One byte per cell, 0 for empty, as the cache stores boards.
+template <int B>
+std::string cacheKey(const Board<B> &board)
+{
+    std::string key(board.size(), 0);
+    for (size_t i = 0; i < board.size(); ++i)
+        key[i] = board[i] + 1;
+    return key;
+}
+
+// The file starts with a magic word, the cells per board and the slot count. Each slot
+// is a state byte (0 free, 1 solved, 2 no solution), the key and the solution.
+const char CACHE_MAGIC[8] = {'S', 'U', 'D', 'O', 'C', 'A', 'C', '1'};
+const int CACHE_HEADER_BYTES = 24;
+
+// Maps the cache file for boards of the given size, starting it over when it was
+// written for another size or slot count. Returns false when there is no usable file.
+bool openCacheFile(int cells)
+{
+    if (solveCache.path.empty())
+        return false;
+    if (solveCache.table && solveCache.cells == cells)
+        return true;
+    closeSolveCache();
+    int fd = open(solveCache.path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return false;
+    long long slots = solveCache.capacity;
+    size_t bytes = CACHE_HEADER_BYTES + (size_t)slots * (1 + 2 * cells);
+    struct stat info;
+    bool fresh = fstat(fd, &info) != 0 || (size_t)info.st_size != bytes;
+    if (fresh && (ftruncate(fd, 0) != 0 || ftruncate(fd, bytes) != 0))
+    {
+        close(fd);
+        return false;
+    }
+    void *mapped = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+        return false;
+    uint8_t *table = (uint8_t *)mapped;
+    long long header[2] = {cells, slots};
+    if (fresh || memcmp(table, CACHE_MAGIC, 8) != 0 || memcmp(table + 8, header, 16) != 0)
+    {
+        memset(table, 0, bytes);
+        memcpy(table, CACHE_MAGIC, 8);
+        memcpy(table + 8, header, 16);
+    }
+    solveCache.table = table;
+    solveCache.tableBytes = bytes;
+    solveCache.slots = slots;
+    solveCache.cells = cells;
+    return true;
+}
+
+void closeSolveCache()
+{
+    if (solveCache.table)
+        munmap(solveCache.table, solveCache.tableBytes);
+    solveCache.table = nullptr;
+}
+
+// The file slot of a key, by FNV-1a.
+uint8_t *cacheSlot(const std::string &key)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < key.size(); ++i)
+        hash = (hash ^ (uint8_t)key[i]) * 1099511628211ULL;
+    return solveCache.table + CACHE_HEADER_BYTES + (hash % solveCache.slots) * (1 + 2 * key.size());
+}
+
+// Looks a canonical key up in memory, then in the file. Returns 0 when it is unknown,
+// 1 with its canonical solution in solution, and 2 when it has no solution.
+int findCached(const std::string &key, std::string &solution)
+{
+    std::unordered_map<std::string, std::list<std::pair<std::string, std::string> >::iterator>::iterator found = solveCache.index.find(key);
+    if (found != solveCache.index.end())
+    {
+        solveCache.entries.splice(solveCache.entries.begin(), solveCache.entries, found->second);
+        solution = found->second->second;
+        ++solveCache.hits;
+        return solution.empty() ? 2 : 1;
+    }
+    if (openCacheFile(key.size()))
+    {
+        uint8_t *slot = cacheSlot(key);
+        if (slot[0] != 0 && memcmp(slot + 1, key.data(), key.size()) == 0)
+        {
+            solution = slot[0] == 1 ? std::string((const char *)slot + 1 + key.size(), key.size()) : std::string();
+            storeCached(key, solution);
+            ++solveCache.hits;
+            return slot[0];
+        }
+    }
+    ++solveCache.misses;
+    return 0;
+}
+
+// Records a canonical key and its canonical solution, empty when there is none, and
+// evicts the least recently used entry once the cache is full.
+void storeCached(const std::string &key, const std::string &solution)
+{
+    std::unordered_map<std::string, std::list<std::pair<std::string, std::string> >::iterator>::iterator found = solveCache.index.find(key);
+    if (found != solveCache.index.end())
+    {
+        found->second->second = solution;
+        solveCache.entries.splice(solveCache.entries.begin(), solveCache.entries, found->second);
+    }
+    else
+    {
+        solveCache.entries.push_front(std::make_pair(key, solution));
+        solveCache.index[key] = solveCache.entries.begin();
+        if (solveCache.entries.size() > solveCache.capacity)
+        {
+            solveCache.index.erase(solveCache.entries.back().first);
+            solveCache.entries.pop_back();
+        }
+    }
+    if (openCacheFile(key.size()))
+    {
+        uint8_t *slot = cacheSlot(key);
+        slot[0] = solution.empty() ? 2 : 1;
+        memcpy(slot + 1, key.data(), key.size());
+        if (!solution.empty())
+            memcpy(slot + 1 + key.size(), solution.data(), key.size());
+    }
+}
+
+// Solves one puzzle on every rank of MCW with the given schedule. Rank 0 builds the
+// frontier from puzzle and fills in outcome, the workers pass any board and get back
+// only the solutions they counted. With the steal schedule rank 0 only seeds the
+// workers, which then balance the load themselves. With the portfolio schedule the
+// frontier has one board per group and the workers of a group race over it with
+// different strategies (see makeStrategy). With the shared schedule the ranks of a node
+// claim boards from a shared window (see superviseSharedFrontier). With more than one
+// thread each worker rank runs that many solver threads (see solveOnThreads).
+template <int B>
+void solveShared(int rank, int size, const Board<B> &puzzle, SolverType solver, Schedule schedule, int threads, std::ostream *costLog, std::ostream *solutionsOut, int puzzleNumber, PuzzleOutcome<B> &outcome)
+{
+    constexpr int N = Geometry<B>::N;
+    const int workerQueueSize = 8;
+    //Counting always runs the master schedule with one solver per rank
+    const bool counting = countLimit >= 0;
+    //Kept across puzzles like the worker's pool (see WorkerPool)
+    static std::vector<uint8_t> grant;
+    long long counted = 0;
+    nodesVisited = 0;
+    outcome.winner = -1;
+    outcome.cached = false;
+
+    //A cache hit ends the puzzle for everyone at the broadcast that starts it
+    const bool caching = solveCache.capacity > 0 && !counting;
+    Board<B> canonical;
+    Transform<B> transform;
+    int hit = 0;
+    if (rank == 0 && caching)
+    {
+        std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+        canonicalize<B>(puzzle, canonical, transform);
+        std::string known;
+        hit = findCached(cacheKey<B>(canonical), known);
+        if (hit == 1)
+        {
+            for (int i = 0; i < N * N; ++i)
+                canonical[i] = known[i] - 1;
+            revertTransform<B>(canonical, transform, outcome.solution);
+        }
+        else if (hit == 2)
+        {
+            outcome.solution.assign(N * N, -1);
+        }
+        outcome.cached = hit != 0;
+        outcome.completionTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+    }
+    MPI_Bcast(&hit, 1, MPI_INT, 0, MCW);
+    if (hit)
+    {
+        outcome.frontierSize = 0;
+        outcome.frontierTime = 0;
+        outcome.cancelTime = 0;
+        outcome.nodes = 0;
+        outcome.allocations = 0;
+        outcome.solutions = 0;
+        outcome.rankStats.clear();
+        return;
+    }
+    const bool sharing = schedule == SCHEDULE_SHARED && !counting;
+    if (sharing && sharedFrontier.node == MPI_COMM_NULL)
+        openSharedFrontier();
+    long long allocationsBefore = heapAllocations;
+#ifdef SUDOKU_STATS
+    rankStats = RankStats();
+    std::chrono::steady_clock::time_point wallStart = std::chrono::steady_clock::now();
+#endif
+    if (rank == 0)
+    {
+        //Generate queue, enough for two grants per solver thread
+        Frontier<B> queue;
+        std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+        std::vector<int> groupStart;
+        if (schedule == SCHEDULE_PORTFOLIO && !counting)
+        {
+            generateQueue<B>(queue, puzzle, portfolioGroupCount(size - 1));
+            dealFrontier<B>(queue, portfolioGroupCount(size - 1), groupStart);
+        }
+        else
+            generateQueue<B>(queue, puzzle, 2 * workerQueueSize * (counting ? 1 : threads) * (size - 1));
+        outcome.frontierSize = queue.size();
+        outcome.frontierTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+
+        outcome.solution.assign(N * N, -1);
+        std::chrono::steady_clock::time_point endTime;
+        if (schedule == SCHEDULE_STEAL && !counting)
+        {
+            //Split the whole frontier evenly, the workers balance it among themselves from here
+            int workers = size - 1;
+            int first = 0;
+            for (int i = 1; i < size; ++i)
+            {
+                int share = queue.size() / workers + (i - 1 < (int)queue.size() % workers ? 1 : 0);
+                sendGrant<B>(queue, first, share, i, grant);
+                first += share;
+            }
+            std::vector<uint8_t> packed(Geometry<B>::MAX_PACKED_BYTES);
+            MPI_Status status;
+            MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, MCW, &status);
+            endTime = std::chrono::steady_clock::now();
+            if (status.MPI_TAG == TAG_SOLVED)
+            {
+                MPI_Recv(packed.data(), packed.size(), MPI_BYTE, status.MPI_SOURCE, status.MPI_TAG, MCW, MPI_STATUS_IGNORE);
+                unpackBoard<B>(packed.data(), outcome.solution);
+                outcome.winner = status.MPI_SOURCE;
+            }
+            //The barrier in quiesce completes once every worker has stopped
+            Outbox outbox;
+            quiesce(outbox);
+        }
+        else if (sharing)
+        {
+            outcome.winner = superviseSharedFrontier<B>(queue, outcome.solution, endTime);
+            Outbox outbox;
+            quiesce(outbox);
+        }
+        else
+        {
+            bool portfolio = schedule == SCHEDULE_PORTFOLIO && !counting;
+            outcome.winner = superviseWorkers<B>(size, queue, workerQueueSize, outcome.solution, endTime, portfolio ? &groupStart : nullptr, masterSolves && !portfolio && !counting);
+        }
+        outcome.completionTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime).count();
+        outcome.cancelTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - endTime).count();
+
+        //Store the answer in canonical form, so every symmetric copy of the puzzle finds it
+        if (caching)
+        {
+            Board<B> solved;
+            if (outcome.winner >= 0)
+                applyTransform<B>(outcome.solution, transform, solved);
+            storeCached(cacheKey<B>(canonical), outcome.winner >= 0 ? cacheKey<B>(solved) : std::string());
+        }
+    }
+    else
+    {
+        std::vector<Board<B> > queue;
+        if (counting)
+        {
+            counted = serveWorker<B>(solver, workerQueueSize, grant, costLog, puzzleNumber, nullptr, solutionsOut);
+        }
+        else if (schedule == SCHEDULE_STEAL)
+        {
+            //The seed grant can be any size, so probe for it first
+            int bytes = 0;
+            MPI_Status status;
+            MPI_Probe(0, TAG_GRANT, MCW, &status);
+            MPI_Get_count(&status, MPI_BYTE, &bytes);
+            grant.resize(bytes);
+            MPI_Recv(grant.data(), bytes, MPI_BYTE, 0, TAG_GRANT, MCW, MPI_STATUS_IGNORE);
+            receiveGrant<B>(grant, queue);
+            stealWork<B>(rank, size, queue);
+        }
+        else if (sharing)
+        {
+            //Leaders get their node's share from rank 0, the rest of the node reads it from the window
+            std::vector<typename Geometry<B>::Cell> share;
+            int count = 0;
+            if (sharedFrontier.leaders != MPI_COMM_NULL)
+            {
+                MPI_Scatter(nullptr, 1, MPI_INT, &count, 1, MPI_INT, 0, sharedFrontier.leaders);
+                share.resize((size_t)count * Geometry<B>::CELLS);
+                MPI_Scatterv(nullptr, nullptr, nullptr, MPI_BYTE, share.data(), share.size() * sizeof(share[0]), MPI_BYTE, 0, sharedFrontier.leaders);
+            }
+            fillSharedFrontier<B>(share.data(), count);
+            Outbox outbox;
+            solveSharedFrontier<B>(rank, outbox);
+            quiesce(outbox);
+        }
+        else if (schedule == SCHEDULE_PORTFOLIO)
+        {
+            SearchStrategy strategy = makeStrategy((rank - 1) / portfolioGroupCount(size - 1));
+            serveWorker<B>(solver, workerQueueSize, grant, costLog, puzzleNumber, &strategy);
+        }
+        else if (threads > 1)
+        {
+            solveOnThreads<B>(threads, workerQueueSize, grant);
+        }
+        else
+        {
+            serveWorker<B>(solver, workerQueueSize, grant, costLog, puzzleNumber);
+        }
+    }
+    MPI_Barrier(MCW);
+    long long used[2] = {nodesVisited, rank == 0 ? 0 : heapAllocations - allocationsBefore};
+    long long total[2] = {0, 0};
+    MPI_Reduce(used, total, 2, MPI_LONG_LONG, MPI_SUM, 0, MCW);
+    outcome.nodes = total[0];
+    outcome.allocations = total[1];
+    outcome.solutions = 0;
+    if (counting)
+        MPI_Reduce(&counted, &outcome.solutions, 1, MPI_LONG_LONG, MPI_SUM, 0, MCW);
+#ifdef SUDOKU_STATS
+    long long wall = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - wallStart).count();
+    long long mine[STAT_COLUMNS] = {nodesVisited, rankStats.backtracks, rankStats.placements, rankStats.boards, rankStats.idleMicros, rankStats.mpiMicros, wall};
+    outcome.rankStats.resize(rank == 0 ? (size_t)size * STAT_COLUMNS : 0);
+    MPI_Gather(mine, STAT_COLUMNS, MPI_LONG_LONG, outcome.rankStats.data(), STAT_COLUMNS, MPI_LONG_LONG, 0, MCW);
+#endif
+    drainMessages();
+}
+
+// Generates, distributes and solves timesToRun puzzles of one board size.
+// Rank 0 hands out the frontier and collects the solution, every other rank works.
+template <int B>
+void runPuzzles(int rank, int size, int timesToRun, SolverType solver, Schedule schedule, int threads, std::vector<long long> &allCompletionTimes)
+{
+    if (pipelineDepth > 0 && countLimit < 0)
+    {
+        if (rank == 0 && (schedule != SCHEDULE_MASTER || threads > 1))
+            std::cout << "Pipelined runs always use the master schedule with one solver per rank.\n";
+        runPipeline<B>(rank, size, timesToRun, solver, allCompletionTimes);
+        return;
+    }
+    if (pipelineDepth > 0 && rank == 0)
+        std::cout << "Counting runs are not pipelined.\n";
+    Board<B> puzzle;
+    PuzzleOutcome<B> outcome;
+    std::vector<long long> allCancelTimes;
+    int puzzleNumber = 0;
+    std::ofstream costLog;
+    if (rank > 0 && !costLogPath.empty())
+    {
+        costLog.open(costLogPath + "." + std::to_string(rank));
+        costLog << "puzzle,estimated_log2_nodes,actual_nodes,outcome\n";
+    }
+    const bool counting = countLimit >= 0;
+    std::ofstream solutionsOut;
+    if (rank > 0 && counting && !solutionsPath.empty())
+        solutionsOut.open(solutionsPath + "." + std::to_string(rank));
+
+    while (timesToRun > 0)
+    {
+        ++puzzleNumber;
+        if (rank == 0)
+        {
+            std::cout <<"Starting\n";
+            std::mt19937 rng(generatorSeed + puzzleNumber - 1);
+            long long difficulty = -1;
+            puzzle = generatePuzzle<B>(true, rng, &difficulty);
+            reportShortfall(difficulty);
+            std::cout << "Puzzle to be solved: \n";
+            printPuzzle<B>(puzzle);
+        }
+        solveShared<B>(rank, size, puzzle, solver, schedule, threads, costLog.is_open() ? &costLog : nullptr, solutionsOut.is_open() ? &solutionsOut : nullptr, puzzleNumber, outcome);
+        if (rank == 0)
+        {
+            if (outcome.cached)
+            {
+                std::cout << "Answered from the solve cache in " << outcome.completionTime << " microseconds";
+                if (outcome.solution[0] == -1)
+                {
+                    std::cout << ": the puzzle has no solution.\n";
+                }
+                else
+                {
+                    std::cout << ": \n";
+                    printPuzzle<B>(outcome.solution);
+                }
+                allCompletionTimes.push_back(outcome.completionTime);
+                timesToRun--;
+                continue;
+            }
+            std::cout << "Frontier of " << outcome.frontierSize << " boards built in " << outcome.frontierTime << " microseconds.\n";
+            if (outcome.winner >= 0)
+            {
+                std::cout << "Worker " << outcome.winner << " solved the puzzle";
+                if (schedule == SCHEDULE_PORTFOLIO)
+                    std::cout << " with " << makeStrategy((outcome.winner - 1) / portfolioGroupCount(size - 1)).name;
+                std::cout << ": \n";
+                printPuzzle<B>(outcome.solution);
+            }
+            else if (!counting)
+            {
+                std::cout << "The workers ran out of work: the puzzle has no solution.\n";
+            }
+            if (counting && countLimit > 0 && outcome.solutions >= countLimit)
+                std::cout << "Stopped at " << countLimit << " solutions, the workers had found " << outcome.solutions << ".\n";
+            else if (counting)
+                std::cout << "The puzzle has " << outcome.solutions << (outcome.solutions == 1 ? " solution.\n" : " solutions.\n");
+            std::cout << "Search nodes across all workers: " << outcome.nodes << "\n";
+            std::cout << "Time from puzzle creation to puzzle solution was " << outcome.completionTime << " microseconds.\n";
+            std::cout << "Time from puzzle solution to all workers idle was " << outcome.cancelTime << " microseconds.\n";
+            printRankStats(outcome.rankStats, size);
+            allCompletionTimes.push_back(outcome.completionTime);
+            allCancelTimes.push_back(outcome.cancelTime);
+        }
+
+        timesToRun--;
+    }
+    if (rank == 0 && !allCancelTimes.empty())
+    {
+        std::sort(allCancelTimes.begin(), allCancelTimes.end());
+        std::cout << "Cancellation latency (solution to all workers idle): median " << percentile(allCancelTimes, 50);
+        std::cout << ", p99 " << percentile(allCancelTimes, 99);
+        std::cout << ", worst " << allCancelTimes.back() << " microseconds.\n";
+    }
+    if (rank == 0 && solveCache.capacity > 0)
+        std::cout << "Solve cache: " << solveCache.hits << " hits, " << solveCache.misses << " misses.\n";
+    closeSolveCache();
+    releaseSharedFrontier();
+}
+
+// One puzzle of a pipelined run (see runPipeline): its frontier, the cursor of the next
+// board to hand out and the grants still out with workers.
+template <int B>
+struct PipelinePuzzle
+{
+    int id;
+    Board<B> puzzle;
+    Frontier<B> frontier;
+    std::vector<double> weight;
+    double budget;
+    int next;
+    int outstanding;
+    std::chrono::steady_clock::time_point startTime;
+};
+
+// Prints a finished pipelined puzzle and records its time. winner is the solving rank,
+// or -1 when the frontier ran out without a solution.
+template <int B>
+void finishPipelined(PipelinePuzzle<B> &p, int winner, const Board<B> &solution, std::vector<long long> &allCompletionTimes)
+{
+    long long elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - p.startTime).count();
+    std::cout << "Puzzle " << p.id << ": \n";
+    printPuzzle<B>(p.puzzle);
+    if (winner >= 0)
+    {
+        std::cout << "Worker " << winner << " solved puzzle " << p.id << " in " << elapsed << " microseconds: \n";
+        printPuzzle<B>(solution);
+    }
+    else
+    {
+        std::cout << "Puzzle " << p.id << " has no solution, found out in " << elapsed << " microseconds.\n";
+    }
+    allCompletionTimes.push_back(elapsed);
+}
+
+// Gives worker w (rank w + 1) the next grant of the oldest puzzle with boards left, as
+// the boards of a normal grant followed by the puzzle id. Returns that id, or -1 when
+// nothing is left to hand out.
+template <int B>
+int pipelineGrant(std::vector<PipelinePuzzle<B> > &inflight, int w, int workerQueueSize, std::vector<uint8_t> &buffer)
+{
+    for (size_t i = 0; i < inflight.size(); ++i)
+    {
+        PipelinePuzzle<B> &p = inflight[i];
+        if (p.next == p.frontier.size())
+            continue;
+        int quantity = 0;
+        double spent = 0;
+        while (p.next + quantity < p.frontier.size() && quantity < workerQueueSize && (quantity == 0 || spent + p.weight[p.next + quantity] <= p.budget))
+            spent += p.weight[p.next + quantity++];
+        int bytes = packGrant<B>(p.frontier, p.next, quantity, buffer);
+        buffer.resize(bytes + sizeof(int));
+        memcpy(buffer.data() + bytes, &p.id, sizeof(int));
+        p.next += quantity;
+        ++p.outstanding;
+        TRACE_INSTANT("grant", quantity);
+        MPI_Send(buffer.data(), bytes + sizeof(int), MPI_BYTE, w + 1, TAG_PIPE_GRANT, MCW);
+        return p.id;
+    }
+    return -1;
+}
+
+// Worker side of a pipelined run. Solves one grant at a time and answers each with a
+// result, which doubles as the request for the next grant: the puzzle id, a status
+// (PIPE_SOLVED, PIPE_EXHAUSTED or PIPE_CANCELLED) and the solution when there is one.
+// While solving, pollCancel looks for a TAG_CANCEL naming the grant's puzzle. An empty
+// grant ends the run.
+template <int B>
+void servePipeline(SolverType solver)
+{
+    std::vector<uint8_t> grant;
+    std::vector<Board<B> > queue;
+    std::vector<uint8_t> result(2 * sizeof(int) + Geometry<B>::MAX_PACKED_BYTES);
+    Outbox outbox;
+    while (true)
+    {
+        int bytes = 0;
+        MPI_Status status;
+        {
+            STAT_TIMER(idleTimer, idleMicros);
+            TRACE_SPAN(idleSpan, "idle");
+            MPI_Probe(0, TAG_PIPE_GRANT, MCW, &status);
+        }
+        MPI_Get_count(&status, MPI_BYTE, &bytes);
+        grant.resize(bytes);
+        MPI_Recv(grant.data(), bytes, MPI_BYTE, 0, TAG_PIPE_GRANT, MCW, MPI_STATUS_IGNORE);
+        queue.clear();
+        if (receiveGrant<B>(grant, queue) == 0)
+            break;
+        memcpy(&pipelinePuzzle, grant.data() + bytes - sizeof(int), sizeof(int));
+        pipelineStopped = false;
+        int outcome = PIPE_EXHAUSTED;
+        int length = 2 * sizeof(int);
+        for (size_t i = 0; i < queue.size() && outcome == PIPE_EXHAUSTED; ++i)
+        {
+            TRACE_SPAN(solveSpan, "solve");
+            if (solveWith<B>(solver, queue[i]))
+            {
+                outcome = PIPE_SOLVED;
+                length += packBoard<B>(queue[i], result.data() + length);
+            }
+            else if (pipelineStopped)
+            {
+                outcome = PIPE_CANCELLED;
+            }
+        }
+        memcpy(result.data(), &pipelinePuzzle, sizeof(int));
+        memcpy(result.data() + sizeof(int), &outcome, sizeof(int));
+        pipelinePuzzle = -1;
+        MPI_Send(result.data(), length, MPI_BYTE, 0, TAG_PIPE_RESULT, MCW);
+    }
+    TRACE_INSTANT("stopped", -1);
+    quiesce(outbox);
+}
+
+// Rank 0 side of a pipelined run: solves timesToRun puzzles with up to pipelineDepth of
+// them in flight. Every puzzle gets its own frontier and id, and a worker that reports
+// back gets the next grant of the oldest puzzle that still has boards, so the tail of
+// one puzzle overlaps the start of the next. A solution cancels only the workers still
+// on that puzzle. There is no barrier between puzzles, only one quiesce at the end.
+// With the solve cache on, cached puzzles finish as soon as they are generated.
+template <int B>
+void runPipeline(int rank, int size, int timesToRun, SolverType solver, std::vector<long long> &allCompletionTimes)
+{
+    constexpr int N = Geometry<B>::N;
+    const int workerQueueSize = 8;
+    nodesVisited = 0;
+    long long totalNodes = 0;
+    MPI_Barrier(MCW);
+    if (rank > 0)
+    {
+        servePipeline<B>(solver);
+        MPI_Reduce(&nodesVisited, &totalNodes, 1, MPI_LONG_LONG, MPI_SUM, 0, MCW);
+        return;
+    }
+
+    int workers = size - 1;
+    std::vector<PipelinePuzzle<B> > inflight;
+    std::vector<int> working(workers, -1);
+    std::vector<uint8_t> buffer;
+    std::vector<uint8_t> result(2 * sizeof(int) + Geometry<B>::MAX_PACKED_BYTES);
+    Board<B> solution;
+    Outbox outbox;
+    int generated = 0;
+    int finished = 0;
+    std::chrono::steady_clock::time_point runStart = std::chrono::steady_clock::now();
+    while (finished < timesToRun)
+    {
+        //Keep the pipeline full
+        while ((int)inflight.size() < pipelineDepth && generated < timesToRun)
+        {
+            PipelinePuzzle<B> p;
+            p.id = ++generated;
+            p.startTime = std::chrono::steady_clock::now();
+            std::mt19937 rng(generatorSeed + p.id - 1);
+            long long difficulty = -1;
+            p.puzzle = generatePuzzle<B>(true, rng, &difficulty);
+            reportShortfall(difficulty);
+            if (solveCache.capacity > 0)
+            {
+                Board<B> form;
+                Transform<B> transform;
+                std::string known;
+                canonicalize<B>(p.puzzle, form, transform);
+                int hit = findCached(cacheKey<B>(form), known);
+                if (hit)
+                {
+                    solution.assign(N * N, -1);
+                    for (int i = 0; i < N * N && hit == 1; ++i)
+                        form[i] = known[i] - 1;
+                    if (hit == 1)
+                        revertTransform<B>(form, transform, solution);
+                    std::cout << "Puzzle " << p.id << " answered from the solve cache.\n";
+                    finishPipelined<B>(p, hit == 1 ? 0 : -1, solution, allCompletionTimes);
+                    ++finished;
+                    continue;
+                }
+            }
+            generateQueue<B>(p.frontier, p.puzzle, 2 * workerQueueSize * workers / pipelineDepth + workers);
+            p.weight.resize(p.frontier.size());
+            p.budget = 0;
+            for (int i = 0; i < p.frontier.size(); ++i)
+            {
+                p.weight[i] = exp2(p.frontier.cost[i] - p.frontier.cost[0]);
+                p.budget += p.weight[i];
+            }
+            p.budget /= 2.0 * workers;
+            p.next = 0;
+            p.outstanding = 0;
+            if (p.frontier.size() == 0)
+            {
+                finishPipelined<B>(p, -1, solution, allCompletionTimes);
+                ++finished;
+                continue;
+            }
+            inflight.push_back(p);
+        }
+        for (int w = 0; w < workers; ++w)
+            if (working[w] < 0)
+                working[w] = pipelineGrant<B>(inflight, w, workerQueueSize, buffer);
+        if (finished == timesToRun)
+            break;
+
+        //Wait for the next result, which also frees its worker
+        MPI_Status status;
+        MPI_Recv(result.data(), result.size(), MPI_BYTE, MPI_ANY_SOURCE, TAG_PIPE_RESULT, MCW, &status);
+        int w = status.MPI_SOURCE - 1;
+        int id, outcome;
+        memcpy(&id, result.data(), sizeof(int));
+        memcpy(&outcome, result.data() + sizeof(int), sizeof(int));
+        working[w] = -1;
+        size_t i = 0;
+        while (i < inflight.size() && inflight[i].id != id)
+            ++i;
+        //Results of puzzles that already finished only free the worker
+        if (i == inflight.size())
+            continue;
+        PipelinePuzzle<B> &p = inflight[i];
+        --p.outstanding;
+        if (outcome == PIPE_SOLVED)
+        {
+            unpackBoard<B>(result.data() + 2 * sizeof(int), solution);
+            for (int v = 0; v < workers; ++v)
+                if (working[v] == id)
+                    postSend(outbox, &id, sizeof(int), v + 1, TAG_CANCEL);
+            finishPipelined<B>(p, w + 1, solution, allCompletionTimes);
+        }
+        else if (p.next == p.frontier.size() && p.outstanding == 0)
+        {
+            finishPipelined<B>(p, -1, solution, allCompletionTimes);
+        }
+        else
+        {
+            continue;
+        }
+        if (solveCache.capacity > 0)
+        {
+            Board<B> form, solved;
+            Transform<B> transform;
+            canonicalize<B>(p.puzzle, form, transform);
+            if (outcome == PIPE_SOLVED)
+                applyTransform<B>(solution, transform, solved);
+            storeCached(cacheKey<B>(form), outcome == PIPE_SOLVED ? cacheKey<B>(solved) : std::string());
+        }
+        inflight.erase(inflight.begin() + i);
+        ++finished;
+        reapSends(outbox);
+    }
+
+    //Collect the grants of cancelled puzzles still out, then send everyone home
+    for (int w = 0; w < workers; ++w)
+        while (working[w] >= 0)
+        {
+            MPI_Status status;
+            MPI_Recv(result.data(), result.size(), MPI_BYTE, MPI_ANY_SOURCE, TAG_PIPE_RESULT, MCW, &status);
+            working[status.MPI_SOURCE - 1] = -1;
+        }
+    int none = 0;
+    for (int w = 0; w < workers; ++w)
+        MPI_Send(&none, sizeof(int), MPI_BYTE, w + 1, TAG_PIPE_GRANT, MCW);
+    quiesce(outbox);
+    long long elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - runStart).count();
+    MPI_Reduce(&nodesVisited, &totalNodes, 1, MPI_LONG_LONG, MPI_SUM, 0, MCW);
+    std::cout << "Pipelined " << timesToRun << " puzzles, up to " << pipelineDepth << " in flight, in " << elapsed << " microseconds";
+    std::cout << " (" << std::fixed << std::setprecision(1) << timesToRun * 1e6 / std::max(1LL, elapsed) << " puzzles/second).\n";
+    std::cout.unsetf(std::ios::fixed);
+    std::cout << "Search nodes across all workers: " << totalNodes << "\n";
+    if (solveCache.capacity > 0)
+        std::cout << "Solve cache: " << solveCache.hits << " hits, " << solveCache.misses << " misses.\n";
+    closeSolveCache();
+}
+
+// Prints one line per rank of the counters gathered by solveShared. Busy is the share of
+// the rank's wall time not spent waiting for work. Prints nothing without SUDOKU_STATS.
+void printRankStats(const std::vector<long long> &stats, int size)
+{
+    if (stats.empty())
+        return;
+    std::cout << std::setw(5) << "rank" << std::setw(12) << "nodes" << std::setw(12) << "backtracks" << std::setw(14) << "placements";
+    std::cout << std::setw(8) << "boards" << std::setw(10) << "idle us" << std::setw(10) << "mpi us" << std::setw(10) << "wall us" << std::setw(7) << "busy" << "\n";
+    for (int r = 0; r < size; ++r)
+    {
+        const long long *row = stats.data() + (size_t)r * STAT_COLUMNS;
+        long long busy = row[6] > 0 ? 100 * (row[6] - row[4]) / row[6] : 0;
+        std::cout << std::setw(5) << r;
+        std::cout << std::setw(12) << row[0] << std::setw(12) << row[1] << std::setw(14) << row[2] << std::setw(8) << row[3];
+        std::cout << std::setw(10) << row[4] << std::setw(10) << row[5] << std::setw(10) << row[6] << std::setw(6) << busy << "%\n";
+    }
+}
+
+// Gathers every rank's trace events to rank 0, which writes them to tracePath as one
+// Chrome trace (chrome://tracing or Perfetto): one process per rank, one thread per
+// solver thread. Collective over MPI_COMM_WORLD. Does nothing without SUDOKU_STATS.
+void writeTrace(int rank, int size)
+{
+#ifdef SUDOKU_STATS
+    if (!tracing)
+        return;
+    std::string text;
+    for (size_t i = 0; i < traceEvents.size(); ++i)
+    {
+        const TraceEvent &event = traceEvents[i];
+        text += ",\n{\"name\": \"" + std::string(event.name) + "\", \"ph\": \"" + event.phase + "\", \"pid\": " + std::to_string(rank);
+        text += ", \"tid\": " + std::to_string(event.thread) + ", \"ts\": " + std::to_string(event.start);
+        if (event.phase == 'X')
+            text += ", \"dur\": " + std::to_string(event.duration);
+        else
+            text += ", \"s\": \"t\"";
+        if (event.value >= 0)
+            text += ", \"args\": {\"value\": " + std::to_string(event.value) + "}";
+        text += "}";
+    }
+    int bytes = text.size();
+    std::vector<int> counts(size), offsets(size);
+    MPI_Gather(&bytes, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+    std::vector<char> all;
+    if (rank == 0)
+    {
+        for (int r = 1; r < size; ++r)
+            offsets[r] = offsets[r - 1] + counts[r - 1];
+        all.resize(offsets[size - 1] + counts[size - 1]);
+    }
+    MPI_Gatherv(text.data(), bytes, MPI_CHAR, all.data(), counts.data(), offsets.data(), MPI_CHAR, 0, MPI_COMM_WORLD);
+    if (rank != 0)
+        return;
+    std::ofstream out(tracePath);
+    out << "{\"traceEvents\": [";
+    for (int r = 0; r < size; ++r)
+        out << (r ? ",\n" : "\n") << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << r << ", \"args\": {\"name\": \"rank " << r << "\"}}";
+    out.write(all.data(), all.size());
+    out << "\n]}\n";
+    std::cout << "Trace of " << all.size() << " bytes written to " << tracePath << "\n";
+#else
+    (void)rank;
+    (void)size;
+#endif
+}
+
+bool mapPuzzleFile(const char *path, PuzzleFile &file)
+{
+    file.data = nullptr;
+    file.count = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+    file.bytes = info.st_size;
+    void *mapped = mmap(nullptr, file.bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+        return false;
+    file.data = (const char *)mapped;
+    madvise(mapped, file.bytes, MADV_SEQUENTIAL);
+
+    //The first line fixes the puzzle length and the line ending for the whole file
+    const char *newline = (const char *)memchr(file.data, '\n', file.bytes);
+    file.stride = newline ? (int)(newline - file.data) + 1 : (int)file.bytes;
+    file.length = newline ? (int)(newline - file.data) : (int)file.bytes;
+    if (file.length > 0 && file.data[file.length - 1] == '\r')
+        --file.length;
+    if ((long long)file.bytes >= file.length)
+        file.count = (file.bytes - file.length) / file.stride + 1;
+    return true;
+}
+
+void unmapPuzzleFile(PuzzleFile &file)
+{
+    if (file.data)
+        munmap((void *)file.data, file.bytes);
+    file.data = nullptr;
+}
+
+// Reads one line into an existing board without allocating. Returns false on an unknown character.
+template <int B>
+bool parsePuzzle(const char *line, Board<B> &puzzle)
+{
+    constexpr int N = Geometry<B>::N;
+    for (int i = 0; i < N * N; ++i)
+    {
+        char c = line[i];
+        if (c == '.' || c == '0')
+        {
+            puzzle[i] = -1;
+            continue;
+        }
+        const char *digit = (const char *)memchr(DIGIT_CHARS, c, N);
+        if (!digit)
+            return false;
+        puzzle[i] = digit - DIGIT_CHARS + 1;
+    }
+    return true;
+}
+
+// Writes the board as one line plus newline. Unsolved puzzles are written as all '.'.
+template <int B>
+void formatSolution(const Board<B> &puzzle, bool solved, char *line)
+{
+    constexpr int N = Geometry<B>::N;
+    for (int i = 0; i < N * N; ++i)
+        line[i] = solved ? DIGIT_CHARS[puzzle[i] - 1] : '.';
+    line[N * N] = '\n';
+}
+
+// Bytes of one batch result of the given format. Every format has fixed size records, so
+// the result of puzzle k starts at k * resultBytes in the output.
+template <int B>
+int resultBytes(ResultFormat format)
+{
+    constexpr int CELLS = Geometry<B>::CELLS;
+    if (format == RESULT_TEXT)
+        return 13 + CELLS + 27;
+    if (format == RESULT_BINARY)
+        return 3 * sizeof(long long) + CELLS;
+    return CELLS + 1;
+}
+
+// Writes the batch result of puzzle id, the line index in its file. A text record is the
+// index, the solution line, the solve time in microseconds and the search nodes, right
+// aligned in columns of 12, N * N, 10 and 14 characters. A binary record is the index, the
+// time and the nodes as 64 bit integers in host byte order, then one byte per cell with
+// the digit from 1, or all 0 when the puzzle has no solution.
+template <int B>
+void formatResult(ResultFormat format, long long id, const Board<B> &puzzle, bool solved, long long micros, long long nodes, char *record)
+{
+    constexpr int CELLS = Geometry<B>::CELLS;
+    if (format == RESULT_LINES)
+    {
+        formatSolution<B>(puzzle, solved, record);
+        return;
+    }
+    if (format == RESULT_BINARY)
+    {
+        long long fields[3] = {id, micros, nodes};
+        memcpy(record, fields, sizeof(fields));
+        for (int i = 0; i < CELLS; ++i)
+            record[sizeof(fields) + i] = solved ? puzzle[i] : 0;
+        return;
+    }
+    //snprintf ends with a terminator, so the columns go through a scratch buffer
+    char columns[48];
+    snprintf(columns, sizeof(columns), "%12lld ", id);
+    memcpy(record, columns, 13);
+    formatSolution<B>(puzzle, solved, record + 13);
+    snprintf(columns, sizeof(columns), " %10lld %14lld\n", std::min(micros, 9999999999LL), std::min(nodes, 99999999999999LL));
+    memcpy(record + 13 + CELLS, columns, 27);
+}
+
+// Writes the board as one line plus newline, with '.' for empty cells.
+template <int B>
+void formatPuzzle(const Board<B> &puzzle, char *line)
+{
+    constexpr int N = Geometry<B>::N;
+    for (int i = 0; i < N * N; ++i)
+        line[i] = puzzle[i] == -1 ? '.' : DIGIT_CHARS[puzzle[i] - 1];
+    line[N * N] = '\n';
+}
+
+// Writes count unique puzzles to outPath in the batch file format. Puzzle k comes from
+// generatorSeed + k and rank k % size makes it, writing its line straight to its place
+// in the file, so the corpus is the same for any number of ranks.
+template <int B>
+void generateCorpus(int rank, int size, long long count, const std::string &outPath)
+{
+    constexpr int N = Geometry<B>::N;
+    const int lineBytes = N * N + 1;
+    Board<B> puzzle(N * N);
+    std::vector<char> line(lineBytes);
+    std::mt19937 rng;
+
+    MPI_Barrier(MCW);
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    int ok = 1;
+    if (rank == 0)
+    {
+        int fd = open(outPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        ok = fd >= 0 && ftruncate(fd, count * lineBytes) == 0;
+        if (fd >= 0)
+            close(fd);
+    }
+    MPI_Bcast(&ok, 1, MPI_INT, 0, MCW);
+    if (!ok)
+    {
+        if (rank == 0)
+            std::cout << "Could not create " << outPath << ".\n";
+        return;
+    }
+
+    int fd = open(outPath.c_str(), O_WRONLY);
+    //Givens, difficulty, and puzzles short of difficultyTarget
+    long long stats[3] = {0, 0, 0};
+    for (long long k = rank; k < count && fd >= 0; k += size)
+    {
+        long long difficulty = 0;
+        rng.seed(generatorSeed + k);
+        puzzle = generatePuzzle<B>(false, rng, &difficulty);
+        formatPuzzle<B>(puzzle, line.data());
+        if (pwrite(fd, line.data(), lineBytes, k * lineBytes) != lineBytes)
+            break;
+        stats[0] += N * N - std::count(puzzle.begin(), puzzle.end(), -1);
+        stats[1] += difficulty;
+        stats[2] += difficulty < difficultyTarget;
+    }
+    if (fd >= 0)
+        close(fd);
+
+    long long totals[3];
+    MPI_Reduce(stats, totals, 3, MPI_LONG_LONG, MPI_SUM, 0, MCW);
+    if (rank == 0)
+    {
+        long long elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+        std::cout << "Generated " << count << " unique puzzles from seed " << generatorSeed << " in " << elapsed << " microseconds.\n";
+        std::cout << "Throughput: " << std::fixed << std::setprecision(1) << count * 1e6 / std::max(elapsed, 1LL) << " puzzles/second.\n";
+        std::cout << "Average givens " << (double)totals[0] / std::max(count, 1LL) << ", average difficulty " << (double)totals[1] / std::max(count, 1LL) << " search nodes.\n";
+        std::cout.unsetf(std::ios::fixed);
+        std::cout << "Puzzles written to " << outPath << "\n";
+        if (totals[2] > 0)
+            std::cerr << totals[2] << " of " << count << " puzzles are easier than --difficulty=" << difficultyTarget << " after " << GENERATE_ATTEMPTS << " tries each.\n";
+    }
+}
+
+// Fills out with the puzzles of a named benchmark set. Returns false for an unknown name.
+bool benchCorpus(const std::string &name, std::vector<Board<3> > &out)
+{
+    out.clear();
+    const char *const *lines = nullptr;
+    int count = 0;
+    if (name == "17")
+    {
+        lines = SEVENTEEN_CLUE_PUZZLES;
+        count = sizeof(SEVENTEEN_CLUE_PUZZLES) / sizeof(SEVENTEEN_CLUE_PUZZLES[0]);
+    }
+    else if (name == "hard")
+    {
+        lines = HARD_PUZZLES;
+        count = sizeof(HARD_PUZZLES) / sizeof(HARD_PUZZLES[0]);
+    }
+    else if (name == "easy")
+    {
+        std::mt19937 rng;
+        for (int k = 0; k < EASY_PUZZLES; ++k)
+        {
+            rng.seed(BENCH_SEED + k);
+            out.push_back(generatePuzzle<3>(false, rng));
+        }
+        return true;
+    }
+    else
+        return false;
+    Board<3> puzzle(81);
+    for (int k = 0; k < count; ++k)
+    {
+        parsePuzzle<3>(lines[k], puzzle);
+        out.push_back(puzzle);
+    }
+    return true;
+}
+
+// One line of the benchmark report. Times are in microseconds, the latencies are each
+// puzzle's time from the start of its frontier to its solution.
+struct BenchRow
+{
+    std::string corpus;
+    std::string scaling;
+    int ranks;
+    int puzzles;
+    int wrong;
+    long long totalTime;
+    long long p50, p90, p99, worst;
+    long long nodes;
+    long long allocations;
+};
+
+// Runs the named sets (or "all" of them) one puzzle at a time across the ranks and
+// reports latency percentiles and throughput. With sweep the sets run on the first 2, 3,
+// 5, 9, ... ranks and then all of them, each on its own communicator, once as they are
+// (strong scaling) and once repeated for every worker (weak scaling). The report goes to
+// stdout, and to reportPath as JSON if it ends in .json or as CSV otherwise.
+void runBenchmark(int rank, int size, const std::string &corpus, SolverType solver, Schedule schedule, int threads, bool sweep, const std::string &reportPath)
+{
+    std::vector<std::string> names;
+    if (corpus == "all")
+        names = {"easy", "17", "hard"};
+    else
+        names.push_back(corpus);
+    //Every rank builds the sets, only rank 0 uses the boards
+    std::vector<std::vector<Board<3> > > sets(names.size());
+    for (size_t c = 0; c < names.size(); ++c)
+    {
+        if (!benchCorpus(names[c], sets[c]))
+        {
+            if (rank == 0)
+                std::cout << "Unknown benchmark set " << names[c] << ", use easy, 17, hard or all.\n";
+            return;
+        }
+    }
+    if (size < 2)
+    {
+        if (rank == 0)
+            std::cout << "The benchmark needs at least 2 ranks.\n";
+        return;
+    }
+
+    std::vector<int> rankCounts;
+    for (int workers = 1; sweep && workers + 1 < size; workers *= 2)
+        rankCounts.push_back(workers + 1);
+    rankCounts.push_back(size);
+    std::vector<BenchRow> rows;
+    PuzzleOutcome<3> outcome;
+    for (size_t r = 0; r < rankCounts.size(); ++r)
+    {
+        int ranks = rankCounts[r];
+        for (int weak = 0; weak <= (sweep ? 1 : 0); ++weak)
+        {
+            MPI_Comm sub;
+            MPI_Comm_split(MPI_COMM_WORLD, rank < ranks ? 0 : MPI_UNDEFINED, rank, &sub);
+            if (rank < ranks)
+            {
+                activeComm = sub;
+                for (size_t c = 0; c < sets.size(); ++c)
+                {
+                    const std::vector<Board<3> > &set = sets[c];
+                    int repeat = weak ? ranks - 1 : 1;
+                    std::vector<long long> latencies;
+                    BenchRow row;
+                    row.corpus = names[c];
+                    row.scaling = sweep ? (weak ? "weak" : "strong") : "fixed";
+                    row.ranks = ranks;
+                    row.puzzles = set.size() * repeat;
+                    row.wrong = 0;
+                    row.nodes = 0;
+                    row.allocations = 0;
+                    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+                    for (int k = 0; k < row.puzzles; ++k)
+                    {
+                        const Board<3> &puzzle = set[k % set.size()];
+                        solveShared<3>(rank, ranks, puzzle, solver, schedule, threads, nullptr, nullptr, k + 1, outcome);
+                        if (rank != 0)
+                            continue;
+                        latencies.push_back(outcome.completionTime);
+                        row.nodes += outcome.nodes;
+                        row.allocations += outcome.allocations;
+                        bool right = (outcome.winner >= 0 || outcome.cached) && isValid<3>(outcome.solution);
+                        for (int i = 0; i < 81 && right; ++i)
+                            right = outcome.solution[i] != -1 && (puzzle[i] == -1 || puzzle[i] == outcome.solution[i]);
+                        row.wrong += !right;
+                    }
+                    if (rank == 0)
+                    {
+                        row.totalTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+                        std::sort(latencies.begin(), latencies.end());
+                        row.p50 = percentile(latencies, 50);
+                        row.p90 = percentile(latencies, 90);
+                        row.p99 = percentile(latencies, 99);
+                        row.worst = latencies.back();
+                        rows.push_back(row);
+                    }
+                }
+                releaseSharedFrontier();
+                activeComm = MPI_COMM_WORLD;
+                MPI_Comm_free(&sub);
+            }
+            MPI_Barrier(MPI_COMM_WORLD);
+        }
+    }
+    if (rank != 0)
+        return;
 
+    std::cout << std::left << std::setw(6) << "set" << std::setw(8) << "scaling" << std::right << std::setw(6) << "ranks";
+    std::cout << std::setw(8) << "puzzles" << std::setw(7) << "wrong" << std::setw(12) << "puzzles/s" << std::setw(10) << "p50 us";
+    std::cout << std::setw(10) << "p90 us" << std::setw(10) << "p99 us" << std::setw(10) << "max us" << std::setw(14) << "nodes" << std::setw(12) << "allocs" << "\n";
+    std::ofstream out;
+    bool json = reportPath.size() >= 5 && reportPath.compare(reportPath.size() - 5, 5, ".json") == 0;
+    if (!reportPath.empty())
+    {
+        out.open(reportPath);
+        if (json)
+            out << "[\n";
+        else
+            out << "set,scaling,ranks,puzzles,wrong,total_us,puzzles_per_second,p50_us,p90_us,p99_us,max_us,nodes,worker_allocations\n";
+    }
+    for (size_t i = 0; i < rows.size(); ++i)
+    {
+        const BenchRow &row = rows[i];
+        double rate = row.puzzles * 1e6 / std::max(row.totalTime, 1LL);
+        std::cout << std::left << std::setw(6) << row.corpus << std::setw(8) << row.scaling << std::right << std::setw(6) << row.ranks;
+        std::cout << std::setw(8) << row.puzzles << std::setw(7) << row.wrong << std::setw(12) << std::fixed << std::setprecision(1) << rate;
+        std::cout << std::setw(10) << row.p50 << std::setw(10) << row.p90 << std::setw(10) << row.p99 << std::setw(10) << row.worst << std::setw(14) << row.nodes << std::setw(12) << row.allocations << "\n";
+        if (!out.is_open())
+            continue;
+        out << std::fixed << std::setprecision(1);
+        if (json)
+        {
+            out << "  {\"set\": \"" << row.corpus << "\", \"scaling\": \"" << row.scaling << "\", \"ranks\": " << row.ranks;
+            out << ", \"puzzles\": " << row.puzzles << ", \"wrong\": " << row.wrong << ", \"total_us\": " << row.totalTime;
+            out << ", \"puzzles_per_second\": " << rate << ", \"p50_us\": " << row.p50 << ", \"p90_us\": " << row.p90;
+            out << ", \"p99_us\": " << row.p99 << ", \"max_us\": " << row.worst << ", \"nodes\": " << row.nodes << ", \"worker_allocations\": " << row.allocations << "}";
+            out << (i + 1 < rows.size() ? ",\n" : "\n");
+        }
+        else
+        {
+            out << row.corpus << "," << row.scaling << "," << row.ranks << "," << row.puzzles << "," << row.wrong << "," << row.totalTime << ",";
+            out << rate << "," << row.p50 << "," << row.p90 << "," << row.p99 << "," << row.worst << "," << row.nodes << "," << row.allocations << "\n";
+        }
+    }
+    std::cout.unsetf(std::ios::fixed);
+    if (json && out.is_open())
+        out << "]\n";
+    if (out.is_open())
+        std::cout << "Report written to " << reportPath << "\n";
+}
 
-    int workerQueueSize = 8;
-    long long completionTime;
+// Candidate masks of Geometry<B>::LANES independent boards side by side: cand[i] holds
+// cell i of every board, one board per vector element. Propagation runs on all of them at
+// once in GCC vector extensions, which the compiler turns into AVX2 or AVX-512 code with
+// -march=native and into plain SSE or scalar code otherwise.
+template <int B>
+struct LaneBatch
+{
+    typedef typename Geometry<B>::LaneWord Word;
+    typedef Word Lanes __attribute__((vector_size(LANE_BYTES)));
+    Lanes cand[Geometry<B>::CELLS];
+    // All ones in the element of every board propagation found a contradiction in.
+    Lanes failed;
+};
 
-    int timesToRun = 10;
-    std::vector<long long> allCompletionTimes;
+// Naked and hidden singles on every board of the batch until none changes. Masks only
+// ever lose bits, so the loop ends. Sets batch.failed for every board that hit a
+// contradiction: an empty cell, a digit twice in a unit or a digit with no place left.
+template <int B>
+void propagateLanes(LaneBatch<B> &batch)
+{
+    constexpr int N = Geometry<B>::N;
+    typedef typename LaneBatch<B>::Lanes Lanes;
+    const PeerTable<B> &table = peerTable<B>;
+    const Lanes zero = {};
+    const Lanes all = zero + (typename LaneBatch<B>::Word)Geometry<B>::ALL_DIGITS;
+    Lanes failed = zero;
+    bool changed = true;
+    while (changed)
+    {
+        Lanes difference = zero;
+        for (int u = 0; u < 3 * N; ++u)
+        {
+            //Digits seen once and more than once in the unit, and the placed ones
+            Lanes once = zero, twice = zero, placed = zero, clash = zero;
+            for (int j = 0; j < N; ++j)
+            {
+                Lanes m = batch.cand[table.units[u][j]];
+                Lanes single = (Lanes)((m & (m - 1)) == 0) & m;
+                twice |= once & m;
+                once |= m;
+                clash |= placed & single;
+                placed |= single;
+            }
+            failed |= (Lanes)(once != all) | (Lanes)(clash != 0);
+            Lanes hidden = once & ~twice;
+            for (int j = 0; j < N; ++j)
+            {
+                Lanes &cell = batch.cand[table.units[u][j]];
+                Lanes m = cell;
+                Lanes open = (Lanes)((m & (m - 1)) != 0);
+                //Naked singles leave the other cells, a hidden single becomes the cell's only digit
+                Lanes n = (m & ~open) | (m & ~placed & open);
+                Lanes h = n & hidden;
+                Lanes only = (Lanes)(h != 0);
+                failed |= only & (Lanes)((h & (h - 1)) != 0);
+                n = (h & only) | (n & ~only);
+                failed |= (Lanes)(n == 0);
+                difference |= n ^ m;
+                cell = n;
+            }
+        }
+        changed = false;
+        for (int l = 0; l < Geometry<B>::LANES; ++l)
+            changed = changed || difference[l] != 0;
+    }
+    batch.failed = failed;
+}
 
-    if(argc > 1) timesToRun = strtol(argv[1], nullptr, 0);
+// Solves puzzles first to first + count of the file in batches of Geometry<B>::LANES and
+// writes one result each, like solveRange. Boards that propagation alone does not finish
+// drop out to the scalar solver, starting from the cells propagation has filled. Each
+// puzzle of a batch is timed with an equal share of the kernel's time.
+// Returns how many puzzles have no solution or could not be read.
+template <int B>
+long long solveLanes(const PuzzleFile &file, long long first, long long count, SolverType solver, ResultFormat format, char *records)
+{
+    constexpr int N = Geometry<B>::N;
+    constexpr int LANES = Geometry<B>::LANES;
+    typedef typename LaneBatch<B>::Word Word;
+    const int recordBytes = resultBytes<B>(format);
+    LaneBatch<B> batch;
+    Board<B> puzzles[LANES];
+    bool readable[LANES];
+    long long unsolved = 0;
+    for (long long k = first; k < first + count; k += LANES)
+    {
+        int used = (int)std::min((long long)LANES, first + count - k);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        //Unused lanes hold an empty board, which propagation leaves alone
+        for (int l = 0; l < LANES; ++l)
+        {
+            readable[l] = l < used && parsePuzzle<B>(file.data + (k + l) * file.stride, puzzles[l]);
+            if (!readable[l])
+                puzzles[l].assign(N * N, -1);
+        }
+        for (int i = 0; i < N * N; ++i)
+        {
+            for (int l = 0; l < LANES; ++l)
+                batch.cand[i][l] = puzzles[l][i] == -1 ? (Word)Geometry<B>::ALL_DIGITS : (Word)((Word)1 << (puzzles[l][i] - 1));
+        }
+        propagateLanes<B>(batch);
+        std::chrono::steady_clock::time_point propagated = std::chrono::steady_clock::now();
+        long long share = std::chrono::duration_cast<std::chrono::microseconds>(propagated - start).count() / used;
+        for (int l = 0; l < used; ++l)
+        {
+            std::chrono::steady_clock::time_point fallback = std::chrono::steady_clock::now();
+            long long nodesBefore = nodesVisited;
+            bool solved = readable[l] && !batch.failed[l];
+            bool open = false;
+            for (int i = 0; i < N * N && solved; ++i)
+            {
+                Word m = batch.cand[i][l];
+                bool single = (m & (m - 1)) == 0;
+                puzzles[l][i] = single ? lowestBit((uint64_t)m) + 1 : -1;
+                open = open || !single;
+            }
+            if (solved && open)
+                solved = solveWith<B>(solver, puzzles[l]);
+            unsolved += !solved;
+            long long micros = share + std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - fallback).count();
+            formatResult<B>(format, k + l, puzzles[l], solved, micros, nodesVisited - nodesBefore, records + (k - first + l) * recordBytes);
+        }
+    }
+    return unsolved;
+}
 
-    while (timesToRun > 0)
+// Solves puzzles first to first + count of the file and writes their results to records,
+// back to back in the given format. Returns how many have no solution or could not be read.
+template <int B>
+long long solveRange(const PuzzleFile &file, long long first, long long count, SolverType solver, bool simd, ResultFormat format, char *records)
+{
+    if (simd)
+        return solveLanes<B>(file, first, count, solver, format, records);
+    const int recordBytes = resultBytes<B>(format);
+    Board<B> puzzle;
+    long long unsolved = 0;
+    for (long long k = first; k < first + count; ++k)
     {
-        MPI_Barrier(MCW);
-        if (rank == 0)
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        long long nodesBefore = nodesVisited;
+        bool solved = parsePuzzle<B>(file.data + k * file.stride, puzzle) && solveWith<B>(solver, puzzle);
+        unsolved += !solved;
+        long long micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        formatResult<B>(format, k, puzzle, solved, micros, nodesVisited - nodesBefore, records + (k - first) * recordBytes);
+    }
+    return unsolved;
+}
+
+// Solves every puzzle in a memory mapped file. Every rank maps the file itself, so rank 0
+// only hands out ranges of line numbers and each worker answers with how many of its
+// range had no solution. The workers open the output file collectively with MPI-IO and
+// write the results of each range straight to its place, record k at k * resultBytes,
+// so the output is in input order no matter which worker finishes first and no results
+// go through rank 0. A worker's write overlaps with solving its next range.
+// With simd the workers run each range through the SIMD batch kernel (see solveLanes).
+template <int B>
+void runBatch(int rank, int size, const PuzzleFile &file, const std::string &outPath, int chunkSize, SolverType solver, bool simd, ResultFormat format)
+{
+    const int recordBytes = resultBytes<B>(format);
+    long long header[3];
+    long long chunk[2];
+    nodesVisited = 0;
+
+    //Open and size the output together, a failure anywhere means nobody writes
+    MPI_File out;
+    int opened = MPI_File_open(MCW, outPath.c_str(), MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL, &out) == MPI_SUCCESS;
+    if (opened)
+        opened = MPI_File_set_size(out, (MPI_Offset)file.count * recordBytes) == MPI_SUCCESS;
+    int everywhere = opened;
+    MPI_Allreduce(MPI_IN_PLACE, &everywhere, 1, MPI_INT, MPI_MIN, MCW);
+    if (opened && !everywhere)
+        MPI_File_close(&out);
+    opened = everywhere;
+
+    MPI_Barrier(MCW);
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    if (rank == 0)
+    {
+        if (!opened)
+            std::cout << "Could not create " << outPath << ", solutions will not be written.\n";
+
+        long long next = 0;
+        long long unsolved = 0;
+        int active = size - 1;
+        //Without workers rank 0 runs through the file itself
+        std::vector<char> records(size == 1 ? (size_t)chunkSize * recordBytes : 0);
+        while (size == 1 && next < file.count)
+        {
+            long long count = std::min((long long)chunkSize, file.count - next);
+            unsolved += solveRange<B>(file, next, count, solver, simd, format, records.data());
+            if (opened)
+                MPI_File_write_at(out, (MPI_Offset)next * recordBytes, records.data(), count * recordBytes, MPI_BYTE, MPI_STATUS_IGNORE);
+            next += count;
+        }
+        MPI_Status status;
+        while (active > 0)
+        {
+            //Every result doubles as the request for the next range
+            MPI_Recv(header, 3, MPI_LONG_LONG, MPI_ANY_SOURCE, TAG_BATCH_RESULT, MCW, &status);
+            unsolved += header[2];
+
+            chunk[0] = next;
+            chunk[1] = std::min((long long)chunkSize, file.count - next);
+            next += chunk[1];
+            if (chunk[1] == 0)
+                --active;
+            MPI_Send(chunk, 2, MPI_LONG_LONG, status.MPI_SOURCE, TAG_BATCH, MCW);
+        }
+        if (opened)
+            MPI_File_close(&out);
+
+        std::chrono::steady_clock::time_point endTime = std::chrono::steady_clock::now();
+        long long elapsed = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime).count();
+        std::cout << "Solved " << file.count - unsolved << " of " << file.count << " puzzles in " << elapsed << " microseconds.\n";
+        std::cout << "Throughput: " << std::fixed << std::setprecision(1) << file.count * 1e6 / std::max(elapsed, 1LL) << " puzzles/second.\n";
+        std::cout.unsetf(std::ios::fixed);
+        if (opened)
+            std::cout << "Solutions written to " << outPath << "\n";
+    }
+    else
+    {
+        //Two buffers, so one range is written out while the next is solved
+        std::vector<char> records[2];
+        MPI_Request writes[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+        int current = 0;
+        //The first message carries no results, it only asks for work
+        header[0] = 0;
+        header[1] = 0;
+        header[2] = 0;
+        MPI_Send(header, 3, MPI_LONG_LONG, 0, TAG_BATCH_RESULT, MCW);
+        while (true)
+        {
+            MPI_Recv(chunk, 2, MPI_LONG_LONG, 0, TAG_BATCH, MCW, MPI_STATUS_IGNORE);
+            if (chunk[1] == 0)
+                break;
+            MPI_Wait(&writes[current], MPI_STATUS_IGNORE);
+            records[current].resize(chunk[1] * recordBytes);
+            header[0] = chunk[0];
+            header[1] = chunk[1];
+            header[2] = solveRange<B>(file, chunk[0], chunk[1], solver, simd, format, records[current].data());
+            if (opened)
+                MPI_File_iwrite_at(out, (MPI_Offset)chunk[0] * recordBytes, records[current].data(), records[current].size(), MPI_BYTE, &writes[current]);
+            MPI_Send(header, 3, MPI_LONG_LONG, 0, TAG_BATCH_RESULT, MCW);
+            current ^= 1;
+        }
+        MPI_Waitall(2, writes, MPI_STATUSES_IGNORE);
+        if (opened)
+            MPI_File_close(&out);
+    }
+
+    long long totalNodes = 0;
+    MPI_Reduce(&nodesVisited, &totalNodes, 1, MPI_LONG_LONG, MPI_SUM, 0, MCW);
+    if (rank == 0)
+        std::cout << "Search nodes across all workers: " << totalNodes << "\n";
+}
+
+void stopService(int signal)
+{
+    serviceStopping = 1;
+}
+
+// Moves the first take requests of pending to taken and their puzzles, back to back and
+// without newlines, to grant.
+void packRequests(std::deque<ServiceRequest> &pending, size_t take, int puzzleChars, std::vector<char> &grant, std::vector<ServiceRequest> &taken)
+{
+    grant.resize(take * puzzleChars);
+    for (size_t k = 0; k < take; ++k)
+    {
+        memcpy(grant.data() + k * puzzleChars, pending.front().puzzle.data(), puzzleChars);
+        taken.push_back(std::move(pending.front()));
+        pending.pop_front();
+    }
+}
+
+// Files line as the reply to request and queues every reply of that client that is now
+// in order. Replies to clients that have gone away are dropped.
+void answerRequest(std::unordered_map<long long, ServiceConnection> &connections, const ServiceRequest &request, const std::string &line, ServiceMetrics &metrics)
+{
+    std::unordered_map<long long, ServiceConnection>::iterator found = connections.find(request.connection);
+    if (found == connections.end())
+        return;
+    ServiceConnection &connection = found->second;
+    ServiceReply &reply = connection.done[request.sequence];
+    reply.line = line;
+    reply.arrival = request.arrival;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    while (!connection.done.empty() && connection.done.begin()->first == connection.nextReply)
+    {
+        const ServiceReply &next = connection.done.begin()->second;
+        connection.output += next.line;
+        long long latency = std::chrono::duration_cast<std::chrono::microseconds>(now - next.arrival).count();
+        if (metrics.recent.size() < SERVICE_WINDOW)
+            metrics.recent.push_back(latency);
+        else
+            metrics.recent[metrics.replies % SERVICE_WINDOW] = latency;
+        ++metrics.replies;
+        connection.done.erase(connection.done.begin());
+        ++connection.nextReply;
+    }
+}
+
+// Takes every complete line out of the input of client id. Puzzles join the queue, the
+// commands and malformed lines are answered on the spot.
+void readRequests(long long id, int puzzleChars, std::deque<ServiceRequest> &pending, std::unordered_map<long long, ServiceConnection> &connections, ServiceMetrics &metrics)
+{
+    ServiceConnection &connection = connections[id];
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    size_t start = 0;
+    size_t end;
+    while ((end = connection.input.find('\n', start)) != std::string::npos)
+    {
+        size_t length = end - start;
+        if (length > 0 && connection.input[end - 1] == '\r')
+            --length;
+        if (length > 0)
+        {
+            ServiceRequest request;
+            request.connection = id;
+            request.sequence = connection.nextSequence++;
+            request.arrival = now;
+            request.puzzle.assign(connection.input, start, length);
+            if (request.puzzle == "stats")
+                answerRequest(connections, request, serviceStats(metrics, pending.size()), metrics);
+            else if (request.puzzle == "shutdown")
+            {
+                serviceStopping = 1;
+                answerRequest(connections, request, "stopping\n", metrics);
+            }
+            else if ((int)length != puzzleChars)
+                answerRequest(connections, request, "error: expected " + std::to_string(puzzleChars) + " cells\n", metrics);
+            else
+                pending.push_back(std::move(request));
+        }
+        start = end + 1;
+    }
+    connection.input.erase(0, start);
+    //Whatever is left is part of a line, and no line is that long
+    if (connection.input.size() > (size_t)puzzleChars + 2)
+    {
+        connection.input.clear();
+        connection.closing = true;
+    }
+}
+
+// One line with the reply count, the queue length and the latency percentiles over the
+// latest replies.
+std::string serviceStats(const ServiceMetrics &metrics, size_t queued)
+{
+    char line[160];
+    if (metrics.recent.empty())
+        snprintf(line, sizeof(line), "replies 0, queued %zu\n", queued);
+    else
+    {
+        std::vector<long long> sorted(metrics.recent);
+        std::sort(sorted.begin(), sorted.end());
+        snprintf(line, sizeof(line), "replies %lld, queued %zu, latency p50 %lld, p90 %lld, p99 %lld microseconds\n", metrics.replies, queued, percentile(sorted, 50), percentile(sorted, 90), percentile(sorted, 99));
+    }
+    return line;
+}
+
+// Worker side of service mode: solves every grant of puzzle lines rank 0 sends and sends
+// back the solution lines, until an empty grant ends the service.
+template <int B>
+void serveRanges(SolverType solver, bool simd)
+{
+    constexpr int CELLS = Geometry<B>::CELLS;
+    std::vector<char> grant;
+    std::vector<char> lines;
+    //A blocking probe spins inside most MPI libraries, so poll and back off while idle: a
+    //busy service answers within 20 microseconds, an idle one wakes up about once a millisecond
+    int backoff = 20;
+    while (true)
+    {
+        int flag = 0;
+        MPI_Status status;
+        MPI_Iprobe(0, TAG_SERVICE_GRANT, MCW, &flag, &status);
+        if (!flag)
         {
-            std::cout <<"Starting" << std::endl;
-            bool isDone = false;
+            usleep(backoff);
+            backoff = std::min(backoff * 2, 1000);
+            continue;
+        }
+        backoff = 20;
+        int bytes;
+        MPI_Get_count(&status, MPI_CHAR, &bytes);
+        grant.resize(bytes);
+        MPI_Recv(grant.data(), bytes, MPI_CHAR, 0, TAG_SERVICE_GRANT, MCW, MPI_STATUS_IGNORE);
+        if (bytes == 0)
+            break;
+        PuzzleFile view = {grant.data(), grant.size(), CELLS, CELLS, bytes / CELLS};
+        lines.resize(view.count * (CELLS + 1));
+        solveRange<B>(view, 0, view.count, solver, simd, RESULT_LINES, lines.data());
+        MPI_Send(lines.data(), lines.size(), MPI_CHAR, 0, TAG_SERVICE_RESULT, MCW);
+    }
+}
+
+// Service mode. Rank 0 listens on a Unix domain socket at socketPath and answers every
+// line its clients send. A line of N * N cells in the batch format is a puzzle and gets
+// its solution line back, or a line of '.' if it has none; "stats" gets the reply count,
+// the queue length and latency percentiles, and "shutdown" stops the service. Puzzles from
+// all clients share one queue, and each idle worker gets an even share of it, at most
+// chunkSize puzzles, so concurrent requests travel in the same grants. Once queueLimit
+// puzzles wait, or a client leaves that many replies unread, its socket is not read any
+// more, and the full socket buffer pushes back on the client.
+template <int B>
+void runService(int rank, int size, const std::string &socketPath, int queueLimit, int chunkSize, SolverType solver, bool simd)
+{
+    constexpr int CELLS = Geometry<B>::CELLS;
+    signal(SIGINT, stopService);
+    signal(SIGTERM, stopService);
+    if (rank != 0)
+    {
+        serveRanges<B>(solver, simd);
+        return;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    const int workers = size - 1;
+    const size_t lineBytes = CELLS + 1;
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    bool listening = listener >= 0 && socketPath.size() < sizeof(address.sun_path);
+    if (listening)
+    {
+        strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+        unlink(socketPath.c_str());
+        listening = bind(listener, (sockaddr *)&address, sizeof(address)) == 0 && listen(listener, 64) == 0;
+    }
+    if (listening)
+    {
+        fcntl(listener, F_SETFL, O_NONBLOCK);
+        std::cout << "Serving " << Geometry<B>::N << "x" << Geometry<B>::N << " puzzles on " << socketPath << " with " << workers << " workers." << std::endl;
+    }
+    else
+    {
+        std::cout << "Could not listen on " << socketPath << ".\n";
+        serviceStopping = 1;
+    }
 
-            //Generate queue
-            std::vector<std::vector<int> > queue;
-            puzzle = generatePuzzle(true);
-            std::cout << "Puzzle to be solved: " << std::endl;
-            printPuzzle(puzzle);
-            std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
-            generateQueue(queue, puzzle);
+    std::unordered_map<long long, ServiceConnection> connections;
+    long long clients = 0;
+    std::deque<ServiceRequest> pending;
+    std::vector<std::vector<ServiceRequest> > assigned(workers);
+    std::vector<std::vector<char> > results(workers, std::vector<char>((size_t)chunkSize * lineBytes));
+    std::vector<MPI_Request> receives(workers, MPI_REQUEST_NULL);
+    ServiceMetrics metrics = {};
+    std::vector<char> grant;
+    std::vector<char> lines;
+    std::vector<ServiceRequest> taken;
+    std::vector<pollfd> fds;
+    std::vector<long long> owners;
+    std::vector<char> chunk(65536);
+    std::chrono::steady_clock::time_point deadline;
+    bool draining = false;
+    while (true)
+    {
+        int busy = 0;
+        for (int w = 0; w < workers; ++w)
+            busy += receives[w] != MPI_REQUEST_NULL;
+        //Once stopped and out of work, give the clients a second to read their last replies
+        if (serviceStopping && pending.empty() && busy == 0)
+        {
+            bool unsent = false;
+            for (std::unordered_map<long long, ServiceConnection>::iterator it = connections.begin(); it != connections.end(); ++it)
+                unsent = unsent || !it->second.output.empty();
+            if (!draining)
+                deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+            draining = true;
+            if (!unsent || std::chrono::steady_clock::now() > deadline)
+                break;
+        }
 
-            //Send initial puzzles
-            int currIndex = 0;
-            int quantity = 0;
-            int remaining = queue.size();
-            for (int i = 1; i < size && remaining > 0; ++i)
+        //Clients are only read while the queue and their unread replies have room
+        fds.clear();
+        owners.clear();
+        if (!serviceStopping)
+        {
+            fds.push_back({listener, POLLIN, 0});
+            owners.push_back(-1);
+        }
+        for (std::unordered_map<long long, ServiceConnection>::iterator it = connections.begin(); it != connections.end(); ++it)
+        {
+            ServiceConnection &connection = it->second;
+            short events = 0;
+            if (!serviceStopping && !connection.closing && pending.size() < (size_t)queueLimit && connection.output.size() < queueLimit * lineBytes)
+                events |= POLLIN;
+            if (!connection.output.empty())
+                events |= POLLOUT;
+            fds.push_back({connection.fd, events, 0});
+            owners.push_back(it->first);
+        }
+        int ready = poll(fds.data(), fds.size(), busy > 0 || !pending.empty() || draining ? 0 : 10);
+        for (size_t i = 0; i < fds.size() && ready > 0; ++i)
+        {
+            if (owners[i] < 0)
             {
-                while (quantity < workerQueueSize && remaining > 0)
+                int fd;
+                while ((fd = accept(listener, nullptr, nullptr)) >= 0)
                 {
-                    ++quantity;
-                    --remaining;
+                    fcntl(fd, F_SETFL, O_NONBLOCK);
+                    ServiceConnection &connection = connections[clients++];
+                    connection.fd = fd;
+                    connection.nextSequence = 0;
+                    connection.nextReply = 0;
+                    connection.closing = false;
                 }
-                MPI_Send(&quantity, 1, MPI_INT, i, TAG_QUANTITY, MCW);
-                for (int j = 0; j < quantity; ++j)
+                continue;
+            }
+            ServiceConnection &connection = connections[owners[i]];
+            bool broken = (fds[i].revents & POLLERR) != 0;
+            if (fds[i].revents & (POLLIN | POLLHUP))
+            {
+                ssize_t got = read(connection.fd, chunk.data(), chunk.size());
+                if (got > 0)
                 {
-                    MPI_Send(queue[currIndex + j].data(), N*N, MPI_INT, i, TAG_PUZZLE, MCW);
+                    connection.input.append(chunk.data(), got);
+                    readRequests(owners[i], CELLS, pending, connections, metrics);
                 }
-                currIndex += quantity;
-                quantity = 0;
+                else if (got == 0)
+                    connection.closing = true;
+                else
+                    broken = broken || errno != EAGAIN;
             }
-
-            MPI_Status status;
-            std::vector<int> data(N * N);
-            int inc = -1;
-            int isIncoming = 0;
-            //While not done
-            while (!isDone)
+            if ((fds[i].revents & POLLOUT) && !connection.output.empty())
+            {
+                ssize_t sent = write(connection.fd, connection.output.data(), connection.output.size());
+                if (sent > 0)
+                    connection.output.erase(0, sent);
+                else
+                    broken = broken || errno != EAGAIN;
+            }
+            //A client that is gone loses its replies, one that is done leaves once they are out
+            if (broken || (connection.closing && connection.output.empty() && connection.nextReply == connection.nextSequence))
             {
+                close(connection.fd);
+                connections.erase(owners[i]);
+            }
+        }
+
+        //Collect the workers' solution lines, one per request of their grant
+        bool progress = false;
+        for (int w = 0; w < workers; ++w)
+        {
+            int flag = 0;
+            if (receives[w] == MPI_REQUEST_NULL)
+                continue;
+            MPI_Test(&receives[w], &flag, MPI_STATUS_IGNORE);
+            if (!flag)
+                continue;
+            for (size_t k = 0; k < assigned[w].size(); ++k)
+                answerRequest(connections, assigned[w][k], std::string(results[w].data() + k * lineBytes, lineBytes), metrics);
+            assigned[w].clear();
+            progress = true;
+        }
+
+        //An even share of the queue for every idle worker, so concurrent requests travel together
+        int idle = 0;
+        for (int w = 0; w < workers; ++w)
+            idle += receives[w] == MPI_REQUEST_NULL;
+        for (int w = 0; w < workers && !pending.empty(); ++w)
+        {
+            if (receives[w] != MPI_REQUEST_NULL || assigned[w].size() > 0)
+                continue;
+            size_t take = std::min((size_t)chunkSize, (pending.size() + idle - 1) / idle);
+            --idle;
+            packRequests(pending, take, CELLS, grant, assigned[w]);
+            MPI_Irecv(results[w].data(), take * lineBytes, MPI_CHAR, w + 1, TAG_SERVICE_RESULT, MCW, &receives[w]);
+            MPI_Send(grant.data(), grant.size(), MPI_CHAR, w + 1, TAG_SERVICE_GRANT, MCW);
+            progress = true;
+        }
+        //Without workers rank 0 solves each share itself
+        if (workers == 0 && !pending.empty())
+        {
+            taken.clear();
+            packRequests(pending, std::min((size_t)chunkSize, pending.size()), CELLS, grant, taken);
+            PuzzleFile view = {grant.data(), grant.size(), CELLS, CELLS, (long long)taken.size()};
+            lines.resize(taken.size() * lineBytes);
+            solveRange<B>(view, 0, view.count, solver, simd, RESULT_LINES, lines.data());
+            for (size_t k = 0; k < taken.size(); ++k)
+                answerRequest(connections, taken[k], std::string(lines.data() + k * lineBytes, lineBytes), metrics);
+            progress = true;
+        }
+        if (ready <= 0 && !progress && (busy > 0 || draining))
+            usleep(20);
+    }
+
+    for (int w = 0; w < workers; ++w)
+        MPI_Send(nullptr, 0, MPI_CHAR, w + 1, TAG_SERVICE_GRANT, MCW);
+    for (std::unordered_map<long long, ServiceConnection>::iterator it = connections.begin(); it != connections.end(); ++it)
+        close(it->second.fd);
+    if (listening)
+        unlink(socketPath.c_str());
+    if (listener >= 0)
+        close(listener);
+    std::cout << "Service stopped after " << clients << " clients: " << serviceStats(metrics, 0) << std::flush;
+}
 
-                //Check for incoming messages
-                MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, MCW, &status);
+// Client of service mode: sends every line of standard input to the service at socketPath
+// and writes the reply lines to standard output, in order, as they come. At the end the
+// latency of each line, from sending it to reading its reply, is summed up on standard
+// error. Returns the exit status.
+int runClient(const std::string &socketPath)
+{
+    signal(SIGPIPE, SIG_IGN);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    if (fd < 0 || connect(fd, (sockaddr *)&address, sizeof(address)) != 0)
+    {
+        std::cerr << "Could not connect to " << socketPath << ".\n";
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
 
-                //If a worker has found the solution
-                if (status.MPI_TAG == TAG_SOLVED)
+    std::string input, outbox, replies;
+    //Stream offsets where the unsent lines end, and when the sent ones went out
+    std::deque<long long> lineEnds;
+    std::deque<std::chrono::steady_clock::time_point> sent;
+    long long queued = 0;
+    long long written = 0;
+    std::vector<long long> latencies;
+    std::vector<char> chunk(65536);
+    bool inputDone = false;
+    bool closed = false;
+    while (!closed && (!inputDone || !lineEnds.empty() || !sent.empty()))
+    {
+        pollfd fds[2] = {{fd, (short)(POLLIN | (outbox.empty() ? 0 : POLLOUT)), 0}, {inputDone || outbox.size() > chunk.size() ? -1 : 0, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[1].revents)
+        {
+            ssize_t got = read(0, chunk.data(), chunk.size());
+            if (got > 0)
+                input.append(chunk.data(), got);
+            else
+            {
+                inputDone = true;
+                if (!input.empty() && input.back() != '\n')
+                    input += '\n';
+            }
+            size_t start = 0;
+            size_t end;
+            while ((end = input.find('\n', start)) != std::string::npos)
+            {
+                size_t length = end - start;
+                if (length > 0 && input[end - 1] == '\r')
+                    --length;
+                //The service skips empty lines, so they get no reply to wait for
+                if (length > 0)
                 {
-                    MPI_Recv(data.data(), N*N, MPI_INT, status.MPI_SOURCE, status.MPI_TAG, MCW, MPI_STATUS_IGNORE);
-                    isDone = true;
-                    std::cout << "Worker " << status.MPI_SOURCE << " solved the puzzle: " << std::endl;
-                    std::chrono::steady_clock::time_point endTime = std::chrono::steady_clock::now();
-                    completionTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime).count();
-                    printPuzzle(data);
-
-                    //Send out poison pills
-                    for (int i = 1; i < size; ++i)
-                    {
-                        //std::cout << "Waiting on " << i << std::endl;
-                        MPI_Request ack;
-                        MPI_Request poison;
-                        int wasAcked = false;
-                        MPI_Irecv(&inc, 1, MPI_INT, i, TAG_ACK, MCW, &ack);
-                        std::vector<MPI_Request> pills;
-                        do
-                        {
-                        MPI_Isend(&inc, 1, MPI_INT, i, TAG_POISON, MCW, &poison);
-                            //Start nonblocking send to i
-                            MPI_Status blocker;
-                            //Check to make sure i isn't sending something already,
-                            //or to see if the send has finished
-                            int isPoisonComplete = 0;
-                            isIncoming = 0;
-                            while (!isIncoming && !isPoisonComplete)
-                            {
-                                MPI_Test(&poison, &isPoisonComplete, MPI_STATUS_IGNORE);
-                                MPI_Iprobe(i, TAG_MORE, MCW, &isIncoming, &blocker);
-                                if(!isIncoming){
-                                    MPI_Iprobe(i, TAG_SOLVED, MCW, &isIncoming, &blocker);
-                                }
-                            }
-                            //If i is trying to send, recieve it
-                            if (isIncoming)
-                            {
-                                //Handle incoming message
-                                if (blocker.MPI_TAG == TAG_MORE)
-                                {
-                                    MPI_Recv(&inc, 1, MPI_INT, blocker.MPI_SOURCE, blocker.MPI_TAG, MCW, MPI_STATUS_IGNORE);
-                                }
-                                else if (status.MPI_TAG == TAG_SOLVED)
-                                {
-                                    MPI_Recv(data.data(), N*N, MPI_INT, blocker.MPI_SOURCE, status.MPI_TAG, MCW, MPI_STATUS_IGNORE);
-                                }
-                            }
-                            //Wait for i to recieve the poison pill so we can continue
-                            MPI_Test(&ack, &wasAcked, MPI_STATUS_IGNORE);
-                        } while (!wasAcked);
-                    }
+                    outbox.append(input, start, length);
+                    outbox += '\n';
+                    queued += length + 1;
+                    lineEnds.push_back(queued);
                 }
-                //If nobody has found a solution, if someone wants more work:
-                else if (status.MPI_TAG == TAG_MORE)
+                start = end + 1;
+            }
+            input.erase(0, start);
+        }
+        if ((fds[0].revents & POLLOUT) && !outbox.empty())
+        {
+            //Read the clock first, the service may answer before write returns
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            ssize_t count = write(fd, outbox.data(), outbox.size());
+            if (count < 0 && errno != EAGAIN)
+                closed = true;
+            if (count > 0)
+            {
+                outbox.erase(0, count);
+                written += count;
+                while (!lineEnds.empty() && lineEnds.front() <= written)
                 {
-                    MPI_Recv(&inc, 1, MPI_INT, status.MPI_SOURCE, status.MPI_TAG, MCW, MPI_STATUS_IGNORE);
-                    while (quantity < workerQueueSize && remaining > 0)
-                    {
-                        ++quantity;
-                        --remaining;
-                    }
-                    MPI_Send(&quantity, 1, MPI_INT, status.MPI_SOURCE, TAG_QUANTITY, MCW);
-                    for (int j = 0; j < quantity; ++j)
-                    {
-                        MPI_Send(queue[currIndex + j].data(), queue[j].size(), MPI_INT, status.MPI_SOURCE, TAG_PUZZLE, MCW);
-                    }
-                    currIndex += quantity;
+                    sent.push_back(now);
+                    lineEnds.pop_front();
                 }
-                //End loop
             }
         }
-        else
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
         {
-            std::vector<std::vector<int> > queue;
-            int workingIndex = 0;
-            bool isDone = false;
-            int isIncoming = 0;
-            int inc = 0;
-            MPI_Status status;
-            //While not done
-            while (!isDone)
+            ssize_t got = read(fd, chunk.data(), chunk.size());
+            if (got <= 0 && !(got < 0 && errno == EAGAIN))
+                closed = true;
+            if (got > 0)
             {
-                //Recieve new work if necessary
-                if (workingIndex == queue.size())
+                replies.append(chunk.data(), got);
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                size_t start = 0;
+                size_t end;
+                while ((end = replies.find('\n', start)) != std::string::npos && !sent.empty())
                 {
-                    MPI_Request pill, puzzles;
-                    workingIndex = 0;
-                    queue.clear();
-                    int quantity;
-                    std::vector<int> data(N * N);
-                    int puzzlesFlag = 0, pillFlag = 0;
-                    MPI_Irecv(&quantity, 1, MPI_INT, 0, TAG_QUANTITY, MCW, &puzzles);
-                    MPI_Irecv(&inc, 1, MPI_INT, 0, TAG_POISON, MCW, &pill);
-                    while (!puzzlesFlag && !pillFlag)
-                    {
-                        MPI_Test(&pill, &pillFlag, MPI_STATUS_IGNORE);
-                        MPI_Test(&puzzles, &puzzlesFlag, MPI_STATUS_IGNORE);
-                    }
-                    if (puzzlesFlag)
-                    {
-                        for (int i = 0; i < quantity; ++i)
-                        {
-                            MPI_Recv(data.data(), N*N, MPI_INT, 0, TAG_PUZZLE, MCW, MPI_STATUS_IGNORE);
-                            queue.push_back(data);
-                        }
-                        MPI_Cancel(&pill);
-                    }
-                    else
-                    {
-                        MPI_Cancel(&puzzles);
-                    }
+                    std::cout.write(replies.data() + start, end + 1 - start);
+                    latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(now - sent.front()).count());
+                    sent.pop_front();
+                    start = end + 1;
                 }
+                replies.erase(0, start);
+                std::cout.flush();
+            }
+        }
+    }
+    close(fd);
 
-                //Do work
-                if (queue.size() > 0)
-                {
-                    isDone = solvePuzzle(queue[workingIndex]);
-                    //Report done if necessary
-                    if (isDone)
-                    {
-                        MPI_Send(queue[workingIndex].data(), queue[workingIndex].size(), MPI_INT, 0, TAG_SOLVED, MCW);
-                    }
-                    //Request more work if necessary
-                    else if (workingIndex + 1 == queue.size())
-                    {
-                        MPI_Send(&inc, 1, MPI_INT, 0, TAG_MORE, MCW);
-                    }
-                    ++workingIndex;
-                }
+    long long outstanding = lineEnds.size() + sent.size();
+    std::cerr << "Received " << latencies.size() << " replies";
+    if (!latencies.empty())
+    {
+        std::sort(latencies.begin(), latencies.end());
+        std::cerr << ", latency p50 " << percentile(latencies, 50) << ", p90 " << percentile(latencies, 90) << ", p99 " << percentile(latencies, 99) << " microseconds";
+    }
+    std::cerr << ".\n";
+    if (outstanding > 0)
+        std::cerr << "The service closed the connection with " << outstanding << " requests unanswered.\n";
+    return outstanding > 0 ? 1 : 0;
+}
 
-                //Check for poison pill
-                MPI_Iprobe(0, TAG_POISON, MCW, &isIncoming, &status);
-                //Recieve poison pill if necessary
-                if (isIncoming || isDone)
-                {
-                    MPI_Recv(&inc, 1, MPI_INT, 0, TAG_POISON, MCW, MPI_STATUS_IGNORE);
-                    isDone = true;
-                }
-                //End loop
+int main(int argc, char **argv)
+{
+    int rank, size, threadSupport;
+
+    //Only the main thread of a rank ever calls MPI, solver threads stay off the network
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &threadSupport);
+    MPI_Comm_rank(MCW, &rank);
+    MPI_Comm_size(MCW, &size);
+    srand(rank + time(0));
+
+    int timesToRun = 10;
+    int puzzleSize = 9;
+    SolverType solver = SOLVER_PROPAGATE;
+    std::string batchPath, outPath;
+    int chunkSize = 512;
+    bool simd = false;
+    ResultFormat format = RESULT_LINES;
+    std::string servicePath, clientPath;
+    int serviceQueue = 4096;
+    Schedule schedule = SCHEDULE_MASTER;
+    int threads = 1;
+    long long generateCount = 0;
+    bool seeded = false;
+    std::string benchSet, benchOut;
+    bool sweep = false;
+    std::vector<long long> allCompletionTimes;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--solver=reference")
+            solver = SOLVER_REFERENCE;
+        else if (arg == "--solver=bitmask")
+            solver = SOLVER_BITMASK;
+        else if (arg == "--solver=dlx")
+            solver = SOLVER_DLX;
+        else if (arg == "--solver=propagate")
+            solver = SOLVER_PROPAGATE;
+        else if (arg == "--schedule=master")
+            schedule = SCHEDULE_MASTER;
+        else if (arg == "--schedule=steal")
+            schedule = SCHEDULE_STEAL;
+        else if (arg == "--schedule=portfolio")
+            schedule = SCHEDULE_PORTFOLIO;
+        else if (arg == "--schedule=shared")
+            schedule = SCHEDULE_SHARED;
+        else if (arg.compare(0, 7, "--seed=") == 0)
+        {
+            generatorSeed = strtoul(arg.c_str() + 7, nullptr, 0);
+            seeded = true;
+        }
+        else if (arg.compare(0, 13, "--difficulty=") == 0)
+            difficultyTarget = std::max(0LL, strtoll(arg.c_str() + 13, nullptr, 0));
+        else if (arg.compare(0, 11, "--generate=") == 0)
+            generateCount = std::max(0LL, strtoll(arg.c_str() + 11, nullptr, 0));
+        else if (arg == "--count")
+            countLimit = 0;
+        else if (arg.compare(0, 8, "--count=") == 0)
+            countLimit = std::max(0LL, strtoll(arg.c_str() + 8, nullptr, 0));
+        else if (arg.compare(0, 12, "--solutions=") == 0)
+            solutionsPath = arg.substr(12);
+        else if (arg.compare(0, 8, "--bench=") == 0)
+            benchSet = arg.substr(8);
+        else if (arg.compare(0, 12, "--bench-out=") == 0)
+            benchOut = arg.substr(12);
+        else if (arg == "--sweep")
+            sweep = true;
+        else if (arg == "--simd")
+            simd = true;
+        else if (arg.compare(0, 8, "--serve=") == 0)
+            servicePath = arg.substr(8);
+        else if (arg.compare(0, 14, "--serve-queue=") == 0)
+            serviceQueue = std::max(1L, strtol(arg.c_str() + 14, nullptr, 0));
+        else if (arg.compare(0, 9, "--client=") == 0)
+            clientPath = arg.substr(9);
+        else if (arg == "--master-solves")
+            masterSolves = true;
+        else if (arg.compare(0, 11, "--pipeline=") == 0)
+            pipelineDepth = std::max(0L, strtol(arg.c_str() + 11, nullptr, 0));
+        else if (arg.compare(0, 8, "--cache=") == 0)
+            solveCache.capacity = std::max(0LL, strtoll(arg.c_str() + 8, nullptr, 0));
+        else if (arg.compare(0, 13, "--cache-file=") == 0)
+            solveCache.path = arg.substr(13);
+        else if (arg.compare(0, 8, "--trace=") == 0)
+            tracePath = arg.substr(8);
+        else if (arg.compare(0, 9, "--groups=") == 0)
+            portfolioGroups = std::max(1L, strtol(arg.c_str() + 9, nullptr, 0));
+        else if (arg.compare(0, 17, "--cancel-latency=") == 0)
+            cancelLatency = std::max(0L, strtol(arg.c_str() + 17, nullptr, 0));
+        else if (arg.compare(0, 9, "--probes=") == 0)
+            costProbes = std::max(0L, strtol(arg.c_str() + 9, nullptr, 0));
+        else if (arg.compare(0, 11, "--cost-log=") == 0)
+            costLogPath = arg.substr(11);
+        else if (arg.compare(0, 10, "--threads=") == 0)
+            threads = std::max(0L, strtol(arg.c_str() + 10, nullptr, 0));
+        else if (arg.compare(0, 7, "--size=") == 0)
+            puzzleSize = strtol(arg.c_str() + 7, nullptr, 0);
+        else if (arg.compare(0, 8, "--batch=") == 0)
+            batchPath = arg.substr(8);
+        else if (arg.compare(0, 6, "--out=") == 0)
+            outPath = arg.substr(6);
+        else if (arg == "--out-format=lines")
+            format = RESULT_LINES;
+        else if (arg == "--out-format=text")
+            format = RESULT_TEXT;
+        else if (arg == "--out-format=binary")
+            format = RESULT_BINARY;
+        else if (arg == "--grids")
+            printGrids = true;
+        else if (arg.compare(0, 8, "--chunk=") == 0)
+            chunkSize = std::max(1L, strtol(arg.c_str() + 8, nullptr, 0));
+        else
+        {
+            //Anything else has to be the number of puzzles, so a mistyped option is not a count of 0
+            char *end;
+            long count = strtol(argv[i], &end, 0);
+            if (end == argv[i] || *end != '\0')
+            {
+                if (rank == 0)
+                    std::cout << "Unknown option " << arg << ".\n";
+                MPI_Finalize();
+                return 1;
             }
-            MPI_Send(&inc, 1, MPI_INT, 0, TAG_ACK, MCW);
+            timesToRun = count;
         }
+    }
+
+    //--threads=0 shares the cores of a node between the ranks placed on it
+    if (threads == 0)
+    {
+        MPI_Comm local;
+        int localSize;
+        MPI_Comm_split_type(MCW, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &local);
+        MPI_Comm_size(local, &localSize);
+        MPI_Comm_free(&local);
+        threads = std::max(1, (int)std::thread::hardware_concurrency() / localSize);
+    }
+    if (threads > 1 && threadSupport < MPI_THREAD_FUNNELED)
+    {
+        if (rank == 0)
+            std::cout << "This MPI library has no thread support, running one solver per rank.\n";
+        threads = 1;
+    }
+    if (masterSolves && threadSupport < MPI_THREAD_FUNNELED)
+    {
+        if (rank == 0)
+            std::cout << "This MPI library has no thread support, rank 0 only supervises.\n";
+        masterSolves = false;
+    }
+
+    //A cache file alone still needs a bound on its entries
+    if (!solveCache.path.empty() && solveCache.capacity == 0)
+        solveCache.capacity = 4096;
+
+    //Timestamps of every rank count from the same barrier
+    if (!tracePath.empty())
+    {
+#ifdef SUDOKU_STATS
+        tracing = true;
         MPI_Barrier(MCW);
+        traceEpoch = std::chrono::steady_clock::now();
+#else
         if (rank == 0)
+            std::cout << "Built without -DSUDOKU_STATS, --trace is ignored.\n";
+#endif
+    }
+
+    //Without --seed every rank still has to generate from the same seed
+    if (!seeded)
+    {
+        generatorSeed = time(0);
+        MPI_Bcast(&generatorSeed, 1, MPI_UNSIGNED, 0, MCW);
+    }
+
+    //Generator mode: write a corpus of unique puzzles for batch mode
+    if (generateCount > 0)
+    {
+        if (outPath.empty())
+            outPath = "puzzles.txt";
+        if (puzzleSize == 9)
+            generateCorpus<3>(rank, size, generateCount, outPath);
+        else if (puzzleSize == 16)
+            generateCorpus<4>(rank, size, generateCount, outPath);
+        else if (puzzleSize == 25)
+            generateCorpus<5>(rank, size, generateCount, outPath);
+        else if (puzzleSize == 36)
+            generateCorpus<6>(rank, size, generateCount, outPath);
+        else
         {
-            std::cout << "Time from puzzle creation to puzzle solution was " << completionTime << " microseconds.\n";
-            allCompletionTimes.push_back(completionTime);
+            if (rank == 0)
+                std::cout << "Unsupported puzzle size " << puzzleSize << ", use 9, 16, 25 or 36.\n";
+            MPI_Finalize();
+            return 1;
         }
+        MPI_Finalize();
+        return 0;
+    }
 
-        timesToRun--;
+    //Benchmark mode: the named 9x9 sets, optionally swept over rank counts
+    if (!benchSet.empty())
+    {
+        runBenchmark(rank, size, benchSet, solver, schedule, threads, sweep, benchOut);
+        writeTrace(rank, size);
+        closeSolveCache();
+        MPI_Finalize();
+        return 0;
+    }
 
-        int t = 0, d = 0;
-        MPI_Status cleanup;
-        MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MCW, &t, &cleanup);
-        while (t)
+    //Client mode: talks to a running service, the other ranks have nothing to do
+    if (!clientPath.empty())
+    {
+        int status = rank == 0 ? runClient(clientPath) : 0;
+        MPI_Finalize();
+        return status;
+    }
+
+    //Service mode: solve puzzles from local clients until stopped
+    if (!servicePath.empty())
+    {
+        if (puzzleSize == 9)
+            runService<3>(rank, size, servicePath, serviceQueue, chunkSize, solver, simd);
+        else if (puzzleSize == 16)
+            runService<4>(rank, size, servicePath, serviceQueue, chunkSize, solver, simd);
+        else if (puzzleSize == 25)
+            runService<5>(rank, size, servicePath, serviceQueue, chunkSize, solver, simd);
+        else if (puzzleSize == 36)
+            runService<6>(rank, size, servicePath, serviceQueue, chunkSize, solver, simd);
+        else
+        {
+            if (rank == 0)
+                std::cout << "Unsupported puzzle size " << puzzleSize << ", use 9, 16, 25 or 36.\n";
+            MPI_Finalize();
+            return 1;
+        }
+        MPI_Finalize();
+        return 0;
+    }
+
+    //Batch mode: the line length of the file decides the board size
+    if (!batchPath.empty())
+    {
+        PuzzleFile file;
+        bool mapped = mapPuzzleFile(batchPath.c_str(), file);
+        if (outPath.empty())
+            outPath = batchPath + ".solved";
+        if (!mapped || (file.length != 81 && file.length != 256 && file.length != 625 && file.length != 1296))
         {
-            MPI_Recv(&d, 1, MPI_INT, MPI_ANY_SOURCE, MPI_ANY_TAG, MCW, &cleanup);
-            MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MCW, &t, &cleanup);
+            if (rank == 0)
+                std::cout << "Could not read puzzles from " << batchPath << ", expected one 81, 256, 625 or 1296 character line per puzzle.\n";
+            unmapPuzzleFile(file);
+            MPI_Finalize();
+            return 1;
         }
+        if (file.length == 81)
+            runBatch<3>(rank, size, file, outPath, chunkSize, solver, simd, format);
+        else if (file.length == 256)
+            runBatch<4>(rank, size, file, outPath, chunkSize, solver, simd, format);
+        else if (file.length == 625)
+            runBatch<5>(rank, size, file, outPath, chunkSize, solver, simd, format);
+        else
+            runBatch<6>(rank, size, file, outPath, chunkSize, solver, simd, format);
+        unmapPuzzleFile(file);
+        MPI_Finalize();
+        return 0;
+    }
+
+    //Each size is its own fully specialised instance, picked once here
+    switch (puzzleSize)
+    {
+    case 9:
+        runPuzzles<3>(rank, size, timesToRun, solver, schedule, threads, allCompletionTimes);
+        break;
+    case 16:
+        runPuzzles<4>(rank, size, timesToRun, solver, schedule, threads, allCompletionTimes);
+        break;
+    case 25:
+        runPuzzles<5>(rank, size, timesToRun, solver, schedule, threads, allCompletionTimes);
+        break;
+    case 36:
+        runPuzzles<6>(rank, size, timesToRun, solver, schedule, threads, allCompletionTimes);
+        break;
+    default:
+        if (rank == 0)
+            std::cout << "Unsupported puzzle size " << puzzleSize << ", use 9, 16, 25 or 36.\n";
+        MPI_Finalize();
+        return 1;
     }
 
 exit:
@@ -655,6 +6221,7 @@ exit:
     {
         report(allCompletionTimes);
     }
+    writeTrace(rank, size);
 
     MPI_Finalize();
 